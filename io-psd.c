@@ -27,26 +27,59 @@
  * - i18n
  */
 
+/* for fileno() */
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
+#include <math.h>
 #include <gdk-pixbuf/gdk-pixbuf-io.h>
 #include <glib/gstdio.h>
 
+/* declares the exported functions, not only their pointer types */
+#define GDK_PIXBUF_PSD_COMPILATION
+#include "io-psd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PSD_X86_SIMD
+#include <immintrin.h>
+#endif
+
 typedef struct
 {
 	guchar  signature[4];  /* file ID, always "8BPS" */
-	guint16 version;       /* version number, always 1 */
+	guint16 version;       /* 1, or 2 for large documents (PSB) */
 	guchar  resetved[6];
 	guint16 channels;      /* number of color channels (1-24) */
 	guint32 rows;          /* height of image in pixels (1-30000) */
 	guint32 columns;       /* width of image in pixels (1-30000) */
+	                       /* (up to 300000 in PSB) */
 	guint16 depth;         /* number of bits per channel (1, 8, 16 or 32) */
 	guint16 color_mode;    /* color mode as defined below */
 } PsdHeader;
 
 #define PSD_HEADER_SIZE 26
 
+/* largest width and height of PSD and PSB (large document) files */
+#define PSD_MAX_DIMENSION 30000
+#define PSB_MAX_DIMENSION 300000
+
+/* Photoshop keeps a JPEG thumbnail of at most 160x160 pixels in image
+   resources; it is only worth looking for when smaller size is requested */
+#define PSD_THUMBNAIL_MAX_SIZE 160
+#define PSD_MAX_RESOURCES_SIZE (16 * 1024 * 1024)
+
+#define PSD_RESOURCE_THUMBNAIL_PS4 1033 /* same as 1036, but BGR */
+#define PSD_RESOURCE_THUMBNAIL 1036
+
+/* files have at most 56 channels */
+#define PSD_MAX_CHANNELS 56
+
+/* at most 5 channels (CMYK and transparency) make up the composite image */
+#define PSD_MAX_PLANES 5
+
 typedef enum
 {
 	PSD_MODE_MONO = 0,
@@ -71,12 +104,36 @@ typedef enum
 	PSD_STATE_COLOR_MODE_BLOCK,
 	PSD_STATE_RESOURCES_BLOCK,
 	PSD_STATE_LAYERS_BLOCK,
+	PSD_STATE_LAYER_INFO,
+	PSD_STATE_LAYERS_TAGGED,
+	PSD_STATE_LAYERS_SKIP,
 	PSD_STATE_COMPRESSION,
 	PSD_STATE_LINES_LENGTHS,
 	PSD_STATE_CHANNEL_DATA,
 	PSD_STATE_DONE
 } PsdReadState;
 
+/* block of working memory of one load; buffers are carved from it and
+   released together */
+typedef struct _PsdArena PsdArena;
+struct _PsdArena
+{
+	PsdArena*          next;          /* blocks allocated before */
+	guchar*            data;          /* aligned start of the block */
+	gsize              size;
+	gsize              used;
+};
+
+/* alignment of arena buffers, enough for AVX2 loads */
+#define PSD_ARENA_ALIGN 32
+
+/* position inside RLE data of a row that arrives in pieces */
+typedef struct
+{
+	guint              literal_left;  /* bytes left to copy */
+	guint              repeat_count;  /* run waiting for its byte */
+} PsdRleState;
+
 typedef struct
 {
 	PsdReadState       state;
@@ -88,38 +145,121 @@ typedef struct
 	GdkPixbufModulePreparedFunc prepared_func; 
 	gpointer                    user_data;
 
-	guchar*            buffer;
+	guchar             buffer[PSD_HEADER_SIZE];
 	guint              bytes_read;
-	guint32            bytes_to_skip;
+	guint64            bytes_to_skip;
 	gboolean           bytes_to_skip_known;
+	guint64            layers_left;   /* bytes of the layers section */
 
 	guint32            width;
 	guint32            height;
+	gint               req_width;     /* size requested by size_func */
+	gint               req_height;
+	guint              out_width;     /* size of the pixbuf */
+	guint              out_height;
+	guint              x0;            /* top left corner of decoded region */
+	guint              y0;
+	gboolean           scaled;        /* decoding to a smaller size */
 	guint16            channels;
 	guint16            depth;
 	guint16            depth_bytes;
 	PsdColorMode       color_mode;
 	PsdCompressionType compression;
+	gboolean           psb;           /* large document format */
 
-	guchar**           ch_bufs;       /* channels buffers */
+	guchar*            line;          /* one decoded channel row */
+	gsize              line_pos;      /* bytes of line decoded so far */
+	PsdRleState        rle;
 	guint              curr_ch;       /* current channel */
 	guint              curr_row;
-	guint              pos;
-	guint16*           lines_lengths;
-	gboolean           finalized;
+	guint32*           lines_lengths;
+	guint64            data_size;     /* size of all channel data */
+
+	/* converts C, M, Y in place once K arrives */
+	void (*apply_k) (guchar* dest, const guchar* k, guint width);
+	/* turns 16-bit rows into 8 bits, adding narrow_bias[row % 4] */
+	void (*narrow) (guchar* dest, const guchar* src, guint width,
+	                const guint16* bias);
+	const guint16    (*narrow_bias)[4];
+	gboolean           preview;       /* show first channel as grayscale */
+	gboolean           has_alpha;     /* first extra channel is transparency */
+
+	PsdArena*          arena;         /* all buffers below except resources */
+	guint64            charged;       /* bytes charged against the budgets */
+
+	guchar*            resources;     /* image resources, when needed */
+	guint32            resources_size;
+
+	/* scaled decoding */
+	guint*             col_start;     /* first column of each output pixel */
+	guint32*           acc;           /* sums of the current output row */
+	guchar*            out_line;      /* scaled channel row */
+	guint              out_row;
+	guint              out_tap;       /* rows of out_row added so far */
 } PsdContext;
 
+/* contexts and arena blocks kept between loads, so back to back loads of
+   similar images do not allocate; off until an application asks for it,
+   as the module is loaded into every process that opens a PSD file */
+#define PSD_POOL_MAX_CONTEXTS 16
+#define PSD_POOL_DEFAULT_SIZE 0
+
+static GMutex pool_lock;
+static PsdArena* pool_blocks;
+static gsize pool_size;          /* bytes in pool_blocks */
+static gsize pool_max_size = PSD_POOL_DEFAULT_SIZE;
+static PsdContext* pool_contexts[PSD_POOL_MAX_CONTEXTS];
+static guint pool_n_contexts;
+
+/* memory budgets of one load and of all loads in progress, 0 for none */
+static GMutex budget_lock;
+static guint64 load_budget;
+static guint64 total_budget;
+static guint64 budget_used;
+
+static gint cmyk_conversion = GDK_PIXBUF_PSD_CMYK_BUILTIN_PROFILE;
+static gint progressive_preview = TRUE;
+static gint sample_conversion = GDK_PIXBUF_PSD_16BIT_TRUNCATE;
+
 
 static guint16
-read_uint16 (guchar* buf)
+read_uint16 (const guchar* buf)
 {
 	return (buf[0] << 8) | buf[1];
 }
 
 static guint32
-read_uint32 (guchar* buf)
+read_uint32 (const guchar* buf)
+{
+	return ((guint32) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static guint64
+read_uint64 (const guchar* buf)
+{
+	return ((guint64) read_uint32(buf) << 32) | read_uint32(buf + 4);
+}
+
+/*
+ * PSB files use 8-byte lengths in the layers section and 4-byte lengths
+ * of RLE rows, twice as large as in PSD.
+ */
+static inline guint
+layers_length_size (PsdContext* ctx)
+{
+	return ctx->psb ? 8 : 4;
+}
+
+static inline guint
+rle_length_size (PsdContext* ctx)
+{
+	return ctx->psb ? 4 : 2;
+}
+
+static guint64
+read_layers_length (PsdContext* ctx, const guchar* buf)
 {
-	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+	return ctx->psb ? read_uint64(buf) : read_uint32(buf);
 }
 
 
@@ -129,7 +269,7 @@ read_uint32 (guchar* buf)
  * str is expected to be at least PSD_HEADER_SIZE long
  */
 static PsdHeader
-psd_parse_header (guchar* str)
+psd_parse_header (const guchar* str)
 {
 	PsdHeader hd;
 	
@@ -168,6 +308,50 @@ feed_buffer (guchar*        buffer,
 	return (*bytes_read == bytes_needed);
 }
 
+/*
+ * Attempts to get a whole line of bytes_needed bytes.
+ *
+ * When nothing has been buffered yet and data already holds the whole
+ * line, *line points straight into data. Only lines split between two
+ * chunks are copied into buffer.
+ *
+ * Returns true if *line is ready and false otherwise
+ * (which means we need to call feed_line again)
+ */
+static gboolean
+feed_line (PsdContext*    ctx,
+           const guchar** data,
+           guint*         size,
+           guint          bytes_needed,
+           guchar*        buffer,
+           const guchar** line)
+{
+	if (ctx->bytes_read == 0 && *size >= bytes_needed) {
+		*line = *data;
+		*data += bytes_needed;
+		*size -= bytes_needed;
+		return TRUE;
+	}
+	if (feed_buffer(buffer, &ctx->bytes_read, data, size, bytes_needed)) {
+		*line = buffer;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Skips what is left of the layers section after the consumed bytes of
+ * the current state, then goes on to image data.
+ */
+static void
+skip_layers_rest (PsdContext* ctx, guint consumed)
+{
+	ctx->bytes_read = 0;
+	ctx->bytes_to_skip = ctx->layers_left - consumed;
+	ctx->bytes_to_skip_known = TRUE;
+	ctx->state = PSD_STATE_LAYERS_SKIP;
+}
+
 /*
  * Attempts to read size of the block and then skip this block.
  *
@@ -177,14 +361,10 @@ feed_buffer (guchar*        buffer,
 static gboolean
 skip_block (PsdContext* context, const guchar** data, guint* size)
 {
-	static guint counter;
-
 	if (!context->bytes_to_skip_known) {
-		context->bytes_read = 0;
 		if (feed_buffer(context->buffer, &context->bytes_read, data, size, 4)) {
 			context->bytes_to_skip = read_uint32(context->buffer);
 			context->bytes_to_skip_known = TRUE;
-			counter = 0;
 		} else {
 			return FALSE;
 		}
@@ -192,11 +372,9 @@ skip_block (PsdContext* context, const guchar** data, guint* size)
 	if (*size < context->bytes_to_skip) {
 		*data += *size;
 		context->bytes_to_skip -= *size;
-		counter += *size;
 		*size = 0;
 		return FALSE;
 	} else {
-		counter += context->bytes_to_skip;
 		*size -= context->bytes_to_skip;
 		*data += context->bytes_to_skip;
 		return TRUE;
@@ -204,222 +382,2730 @@ skip_block (PsdContext* context, const guchar** data, guint* size)
 }
 
 /*
- * Decodes RLE-compressed data
+ * Checks whether RLE data is nothing but repeat runs of one byte that
+ * fill exactly dest_len bytes. Flat artwork is full of such rows.
  */
-static void
-decompress_line(const guchar* src, guint line_length, guchar* dest)
+static gboolean
+is_constant_line (const guchar* src, gsize src_len, gsize dest_len)
 {
-	guint16 bytes_read = 0;
-	int k;
-	while (bytes_read < line_length) {
-		gchar byte = src[bytes_read];
-		++bytes_read;
-	
-		if (byte == -128) {
-			continue;
-		} else if (byte > -1) {
-			gint count = byte + 1;
-		
-			/* copy next count bytes */
-			for (k = 0; k < count; ++k) {
-				*dest = src[bytes_read];
-				++dest;
-				++bytes_read;
+	gsize total = 0;
+	gsize i;
+
+	if (src_len < 2 || src_len % 2 != 0) {
+		return FALSE;
+	}
+	for (i = 0; i < src_len; i += 2) {
+		/* 128 is a no-op, anything above is a repeat run */
+		if (src[i] <= 128 || src[i+1] != src[1]) {
+			return FALSE;
+		}
+		total += 257 - src[i];
+	}
+	return total == dest_len;
+}
+
+/*
+ * Decodes one row of RLE (PackBits) compressed data into dest_len bytes.
+ *
+ * Returns false if the row does not fit in dest or a run is cut off by
+ * the end of data. Rows that decode to fewer bytes are padded with zeros.
+ */
+static gboolean
+decompress_line (const guchar* src, gsize src_len,
+                 guchar* dest, gsize dest_len)
+{
+	const guchar* end = src + src_len;
+	guchar* out = dest;
+	guchar* out_end = dest + dest_len;
+
+	if (is_constant_line(src, src_len, dest_len)) {
+		memset(dest, src[1], dest_len);
+		return TRUE;
+	}
+
+	while (src < end) {
+		gint byte = (gint8) *src++;
+
+		if (byte >= 0) {
+			/* copy next byte + 1 bytes */
+			gsize count = byte + 1;
+			if (count > (gsize) (end - src) ||
+			    count > (gsize) (out_end - out))
+			{
+				return FALSE;
+			}
+			memcpy(out, src, count);
+			src += count;
+			out += count;
+		} else if (byte != -128) {
+			/* copy next byte -byte + 1 times */
+			gsize count = -byte + 1;
+			if (src == end || count > (gsize) (out_end - out)) {
+				return FALSE;
 			}
+			memset(out, *src++, count);
+			out += count;
+		}
+	}
+
+	memset(out, 0, out_end - out);
+	return TRUE;
+}
+
+/*
+ * Decodes a piece of RLE data of a row that arrives in several chunks.
+ *
+ * All src_len bytes are consumed and output is appended to dest at *pos.
+ * A run cut off by the end of src is remembered in state, so decoding
+ * resumes in the middle of it with the next piece.
+ *
+ * Returns false if the output does not fit in dest_len bytes.
+ */
+static gboolean
+decompress_partial (PsdRleState*  state,
+                    const guchar* src,
+                    gsize         src_len,
+                    guchar*       dest,
+                    gsize*        pos,
+                    gsize         dest_len)
+{
+	const guchar* end = src + src_len;
+
+	while (src < end) {
+		if (state->literal_left > 0) {
+			gsize count = MIN(state->literal_left, (gsize) (end - src));
+			if (count > dest_len - *pos) {
+				return FALSE;
+			}
+			memcpy(dest + *pos, src, count);
+			src += count;
+			*pos += count;
+			state->literal_left -= count;
+		} else if (state->repeat_count > 0) {
+			if (state->repeat_count > dest_len - *pos) {
+				return FALSE;
+			}
+			memset(dest + *pos, *src++, state->repeat_count);
+			*pos += state->repeat_count;
+			state->repeat_count = 0;
 		} else {
-			gint count = -byte + 1;
-		
-			/* copy next byte count times */
-			guchar next_byte = src[bytes_read];
-			++bytes_read; 
-			for (k = 0; k < count; ++k) {
-				*dest = next_byte;
-				++dest;
+			gint byte = (gint8) *src++;
+			if (byte >= 0) {
+				state->literal_left = byte + 1;
+			} else if (byte != -128) {
+				state->repeat_count = -byte + 1;
 			}
 		}
 	}
+	return TRUE;
 }
 
+/*
+ * Row kernels.
+ *
+ * Interleaving ones are used when whole rows of all channels are
+ * available at once and pack three or four planar rows into RGB or RGBA.
+ * CMYK ones convert already packed C, M and Y together with a row of K.
+ * Narrowing ones turn rows of 16-bit (big endian) samples into 8 bits as
+ * they are read, so the others only ever see 8-bit planes. Vectorized
+ * versions are picked at runtime; SSE2 alone has no byte shuffle, so the
+ * x86 paths need SSSE3 or AVX2 and everything else uses the scalar loops.
+ */
+typedef void (*NarrowFunc) (guchar*        dest,
+                            const guchar*  src,
+                            guint          width,
+                            const guint16* bias);
+
+typedef void (*InterleaveFunc) (guchar*       dest,
+                                const guchar* r,
+                                const guchar* g,
+                                const guchar* b,
+                                guint         width);
+
+typedef void (*InterleaveAlphaFunc) (guchar*       dest,
+                                     const guchar* r,
+                                     const guchar* g,
+                                     const guchar* b,
+                                     const guchar* a,
+                                     guint         width);
+
+typedef void (*ApplyKFunc) (guchar* dest, const guchar* k, guint width);
+
+typedef struct
+{
+	NarrowFunc     narrow_high;
+	NarrowFunc     narrow_bias;
+	InterleaveFunc rgb8;
+	InterleaveAlphaFunc rgba8;
+	ApplyKFunc     apply_k8;
+	ApplyKFunc     cmyk_lut8;
+} PsdRowKernels;
+
+/* mul_table[k][v] is v * k / 255, rounded */
+static guint8 mul_table[256][256];
+
+/* t / 255, rounded, for t up to 255 * 255 */
+static inline guint
+div255 (guint t)
+{
+	t += 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static inline guint
+mul_div255 (guint v, guint k)
+{
+	return div255(v * k);
+}
+
+/* thresholds of a 4x4 Bayer matrix for narrow_bias, in 1/256 steps */
+static const guint16 dither_bias[4][4] = {
+	{   8, 136,  40, 168 },
+	{ 200,  72, 232, 104 },
+	{  56, 184,  24, 152 },
+	{ 248, 120, 216,  88 }
+};
+
+/* the same bias everywhere rounds to nearest */
+static const guint16 round_bias[4][4] = {
+	{ 128, 128, 128, 128 },
+	{ 128, 128, 128, 128 },
+	{ 128, 128, 128, 128 },
+	{ 128, 128, 128, 128 }
+};
+
+/* keeps the high byte of each sample; dest may be src */
 static void
-reset_context_buffer(PsdContext* ctx)
+narrow_high_scalar (guchar* dest, const guchar* src, guint width,
+                    const guint16* bias)
 {
-	ctx->bytes_read = 0;
-	ctx->bytes_to_skip = 0;
-	ctx->bytes_to_skip_known = FALSE;
+	guint j;
+	for (j = 0; j < width; j++) {
+		dest[j] = src[2*j];
+	}
 }
 
-static gpointer
-gdk_pixbuf__psd_image_begin_load (GdkPixbufModuleSizeFunc size_func,
-                                  GdkPixbufModulePreparedFunc prepared_func,
-                                  GdkPixbufModuleUpdatedFunc updated_func,
-                                  gpointer user_data,
-                                  GError **error)
+/* (v + bias) / 257, rounded down and saturated at 255 */
+static inline guint
+div257_bias (guint v, guint bias)
 {
-	PsdContext* context = g_malloc(sizeof(PsdContext));
-	if (context == NULL) {
-		g_set_error (
-			error,
-			GDK_PIXBUF_ERROR,
-			GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-			("Not enough memory"));
-		return NULL;
+	guint t = MIN(v + bias, 0xffff);
+	return (t - (t >> 8)) >> 8;
+}
+
+/* scales samples to 8 bits adding bias[j % 4] to sample j; dest may be src */
+static void
+narrow_bias_scalar (guchar* dest, const guchar* src, guint width,
+                    const guint16* bias)
+{
+	guint j;
+	for (j = 0; j < width; j++) {
+		dest[j] = div257_bias(read_uint16(src + 2*j), bias[j & 3]);
 	}
-	context->size_func = size_func;
-	context->prepared_func = prepared_func;
-	context->updated_func = updated_func;
-	context->user_data = user_data;
-	
-	context->state = PSD_STATE_HEADER;
+}
 
-	/* we'll allocate larger buffer once we know image size */
-	context->buffer = g_malloc(PSD_HEADER_SIZE);
-	reset_context_buffer(context);
+static void
+interleave_rgb8_scalar (guchar* dest, const guchar* r, const guchar* g,
+                        const guchar* b, guint width)
+{
+	guint j;
+	for (j = 0; j < width; j++) {
+		dest[3*j+0] = r[j];
+		dest[3*j+1] = g[j];
+		dest[3*j+2] = b[j];
+	}
+}
 
-	context->ch_bufs = NULL;
-	context->curr_ch = 0;
-	context->curr_row = 0;
-	context->pos = 0;
-	context->lines_lengths = NULL;
-	context->finalized = FALSE;
+static void
+interleave_rgba8_scalar (guchar* dest, const guchar* r, const guchar* g,
+                         const guchar* b, const guchar* a, guint width)
+{
+	guint j;
+	for (j = 0; j < width; j++) {
+		dest[4*j+0] = r[j];
+		dest[4*j+1] = g[j];
+		dest[4*j+2] = b[j];
+		dest[4*j+3] = a[j];
+	}
+}
 
-	return (gpointer) context;
+/*
+ * Inks are stored inverted (255 means no ink), so the naive conversion
+ * of C, M and Y to R, G and B is a multiplication by K.
+ * Unfortunately, this doesn't work 100% correctly...
+ * CMYK-RGB conversion distorts colors significantly
+ */
+static void
+apply_k8_scalar (guchar* dest, const guchar* k, guint width)
+{
+	guint j;
+	for (j = 0; j < width; j++) {
+		const guint8* t = mul_table[k[j]];
+		dest[3*j+0] = t[dest[3*j+0]];
+		dest[3*j+1] = t[dest[3*j+1]];
+		dest[3*j+2] = t[dest[3*j+2]];
+	}
 }
 
-static gboolean
-gdk_pixbuf__psd_image_stop_load (gpointer context_ptr, GError **error)
+#ifdef PSD_X86_SIMD
+
+/* pshufb masks spreading 16 samples of one channel over 48 bytes of RGB,
+   indexed by [output block * 3 + channel] */
+static const gint8 interleave_masks[9][16] __attribute__((aligned(16))) = {
+	{  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1,  5 },
+	{ -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1 },
+	{ -1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1 },
+	{ -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10, -1 },
+	{  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10 },
+	{ -1,  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1 },
+	{ -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1 },
+	{ -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1 },
+	{ 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15 }
+};
+
+__attribute__((target("ssse3")))
+static inline void
+interleave_16_ssse3 (guchar* dest, __m128i r, __m128i g, __m128i b)
 {
-	PsdContext *ctx = (PsdContext *) context_ptr;
-	gboolean retval = TRUE;
+	int k;
+	for (k = 0; k < 3; k++) {
+		const __m128i* m = (const __m128i*) interleave_masks[3*k];
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(
+				_mm_shuffle_epi8(r, _mm_load_si128(m + 0)),
+				_mm_shuffle_epi8(g, _mm_load_si128(m + 1))),
+			_mm_shuffle_epi8(b, _mm_load_si128(m + 2)));
+		_mm_storeu_si128((__m128i*) (dest + 16*k), v);
+	}
+}
 
-	if (ctx->state != PSD_STATE_DONE) {
-		g_set_error (
-			error,
-			GDK_PIXBUF_ERROR,
-			GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-			("PSD file was corrupted or incomplete."));
-		retval = FALSE;
+/* takes high bytes of 16 big endian samples */
+__attribute__((target("ssse3")))
+static inline __m128i
+narrow_16_ssse3 (const guchar* src)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*) src), lo);
+	__m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i*) (src + 16)), lo);
+	return _mm_packus_epi16(a, c);
+}
+
+__attribute__((target("ssse3")))
+static void
+narrow_high_ssse3 (guchar* dest, const guchar* src, guint width,
+                   const guint16* bias)
+{
+	guint j = 0;
+	for (; j + 16 <= width; j += 16) {
+		_mm_storeu_si128((__m128i*) (dest + j), narrow_16_ssse3(src + 2*j));
 	}
-	
-	g_free(ctx->buffer);
-	g_free(ctx->lines_lengths);
-	if (ctx->ch_bufs) {
-		int i;
-		for (i = 0; i < ctx->channels; i++) {
-			g_free(ctx->ch_bufs[i]);
-		}
+	narrow_high_scalar(dest + j, src + 2*j, width - j, bias);
+}
+
+/* div257_bias for 8 big endian samples */
+__attribute__((target("ssse3")))
+static inline __m128i
+div257_bias_ssse3 (const guchar* src, __m128i bias)
+{
+	__m128i v = _mm_loadu_si128((const __m128i*) src);
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	v = _mm_adds_epu16(v, bias);
+	return _mm_srli_epi16(_mm_sub_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+__attribute__((target("ssse3")))
+static void
+narrow_bias_ssse3 (guchar* dest, const guchar* src, guint width,
+                   const guint16* bias)
+{
+	__m128i b = _mm_loadl_epi64((const __m128i*) bias);
+	guint j = 0;
+
+	b = _mm_unpacklo_epi64(b, b);
+	for (; j + 16 <= width; j += 16) {
+		_mm_storeu_si128((__m128i*) (dest + j), _mm_packus_epi16(
+			div257_bias_ssse3(src + 2*j, b),
+			div257_bias_ssse3(src + 2*j + 16, b)));
 	}
-	g_free(ctx);
-	
-	return retval;
+	narrow_bias_scalar(dest + j, src + 2*j, width - j, bias);
 }
 
+/* pshufb masks repeating each of 16 samples three times over 48 bytes */
+static const gint8 spread_masks[3][16] __attribute__((aligned(16))) = {
+	{  0,  0,  0,  1,  1,  1,  2,  2,  2,  3,  3,  3,  4,  4,  4,  5 },
+	{  5,  5,  6,  6,  6,  7,  7,  7,  8,  8,  8,  9,  9,  9, 10, 10 },
+	{ 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 }
+};
 
-static gboolean
-gdk_pixbuf__psd_image_load_increment (gpointer      context_ptr,
-                                      const guchar *data,
-                                      guint         size,
-                                      GError      **error)
+/* a * k / 255 for 16 bytes, rounded the same way as mul_div255 */
+__attribute__((target("ssse3")))
+static inline __m128i
+mul_div255_ssse3 (__m128i a, __m128i k)
 {
-	PsdContext* ctx = (PsdContext*) context_ptr;
-	int i, j;
-	
-	while (size > 0) {
-		switch (ctx->state) {
-			case PSD_STATE_HEADER:
-				if (feed_buffer(
-						ctx->buffer, &ctx->bytes_read,
-						&data, &size, PSD_HEADER_SIZE))
-				{
-					PsdHeader hd = psd_parse_header(ctx->buffer);
-
-					ctx->width = hd.columns;
-					ctx->height = hd.rows;
-					ctx->channels = hd.channels;
-					ctx->depth = hd.depth;
-					ctx->depth_bytes = (ctx->depth/8 > 0 ? ctx->depth/8 : 1);
-					ctx->color_mode = hd.color_mode;
-					
-					if (ctx->color_mode != PSD_MODE_RGB
-					    && ctx->color_mode != PSD_MODE_GRAYSCALE
-					    && ctx->color_mode != PSD_MODE_CMYK
-					    && ctx->color_mode != PSD_MODE_DUOTONE
-					) {
-						g_set_error (error, GDK_PIXBUF_ERROR,
-							GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
-							("Unsupported color mode"));
-						return FALSE;
-					}
-					
-					if (ctx->depth != 8 && ctx->depth != 16) {
-						g_set_error (error, GDK_PIXBUF_ERROR,
-							GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
-							("Unsupported color depth"));
-						return FALSE;
-					}
-					
-					if (ctx->size_func) {
-						gint w = ctx->width;
-						gint h = ctx->height;
-						ctx->size_func(&w, &h, ctx->user_data);
-						if (w == 0 || h == 0) {
-							return FALSE;
-						}
-					}
-					
-					/* we need buffer that can contain one channel data for one
-					   row in RLE compressed format. 2*width should be enough */
-					g_free(ctx->buffer);
-					ctx->buffer = g_malloc(ctx->width * 2 * ctx->depth_bytes);
-					
-					/* this will be needed for RLE decompression */
-					ctx->lines_lengths =
-						g_malloc(2 * ctx->channels * ctx->height);
-					
-					ctx->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
-						FALSE, 8, ctx->width, ctx->height);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(128);
+	__m128i lo = _mm_add_epi16(half, _mm_mullo_epi16(
+		_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(k, zero)));
+	__m128i hi = _mm_add_epi16(half, _mm_mullo_epi16(
+		_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(k, zero)));
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+	return _mm_packus_epi16(lo, hi);
+}
 
-					if (ctx->lines_lengths == NULL || ctx->buffer == NULL ||
-						ctx->pixbuf == NULL)
-					{
-						g_set_error (error, GDK_PIXBUF_ERROR,
-							GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-							("Insufficient memory to load PSD image file"));
-						return FALSE;
-					}
-					
-					/* create separate buffers for each channel */
-					ctx->ch_bufs = g_malloc(sizeof(guchar*) * ctx->channels);
-					for (i = 0; i < ctx->channels; i++) {
-						ctx->ch_bufs[i] =
-							g_malloc(ctx->width*ctx->height*ctx->depth_bytes);
+__attribute__((target("ssse3")))
+static inline void
+apply_k_16_ssse3 (guchar* dest, __m128i k)
+{
+	int b;
+	for (b = 0; b < 3; b++) {
+		__m128i* p = (__m128i*) (dest + 16*b);
+		__m128i ks = _mm_shuffle_epi8(k,
+			_mm_load_si128((const __m128i*) spread_masks[b]));
+		_mm_storeu_si128(p, mul_div255_ssse3(_mm_loadu_si128(p), ks));
+	}
+}
 
-						if (ctx->ch_bufs[i] == NULL) {
-							g_set_error (error, GDK_PIXBUF_ERROR,
-								GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-								("Insufficient memory to load PSD image file"));
-							return FALSE;
-						}	
-					}
-					
-					ctx->prepared_func(ctx->pixbuf, NULL, ctx->user_data);
-					
-					ctx->state = PSD_STATE_COLOR_MODE_BLOCK;
-					reset_context_buffer(ctx);
-				}
-				break;
-			case PSD_STATE_COLOR_MODE_BLOCK:
-				if (skip_block(ctx, &data, &size)) {
-					ctx->state = PSD_STATE_RESOURCES_BLOCK;
-					reset_context_buffer(ctx);
-				}
-				break;
-			case PSD_STATE_RESOURCES_BLOCK:
+__attribute__((target("ssse3")))
+static void
+apply_k8_ssse3 (guchar* dest, const guchar* k, guint width)
+{
+	guint j = 0;
+	for (; j + 16 <= width; j += 16) {
+		apply_k_16_ssse3(dest + 3*j,
+			_mm_loadu_si128((const __m128i*) (k + j)));
+	}
+	apply_k8_scalar(dest + 3*j, k + j, width - j);
+}
+
+__attribute__((target("ssse3")))
+static void
+interleave_rgb8_ssse3 (guchar* dest, const guchar* r, const guchar* g,
+                       const guchar* b, guint width)
+{
+	guint j = 0;
+	for (; j + 16 <= width; j += 16) {
+		interleave_16_ssse3(dest + 3*j,
+			_mm_loadu_si128((const __m128i*) (r + j)),
+			_mm_loadu_si128((const __m128i*) (g + j)),
+			_mm_loadu_si128((const __m128i*) (b + j)));
+	}
+	interleave_rgb8_scalar(dest + 3*j, r + j, g + j, b + j, width - j);
+}
+
+/* packs 16 samples of four channels into 64 bytes of RGBA; two rounds of
+   unpacking are enough, no shuffle needed */
+__attribute__((target("ssse3")))
+static inline void
+interleave4_16_ssse3 (guchar* dest, __m128i r, __m128i g, __m128i b,
+                      __m128i a)
+{
+	__m128i rg_lo = _mm_unpacklo_epi8(r, g);
+	__m128i rg_hi = _mm_unpackhi_epi8(r, g);
+	__m128i ba_lo = _mm_unpacklo_epi8(b, a);
+	__m128i ba_hi = _mm_unpackhi_epi8(b, a);
+
+	_mm_storeu_si128((__m128i*) dest, _mm_unpacklo_epi16(rg_lo, ba_lo));
+	_mm_storeu_si128((__m128i*) (dest + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+	_mm_storeu_si128((__m128i*) (dest + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+	_mm_storeu_si128((__m128i*) (dest + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+}
+
+__attribute__((target("ssse3")))
+static void
+interleave_rgba8_ssse3 (guchar* dest, const guchar* r, const guchar* g,
+                        const guchar* b, const guchar* a, guint width)
+{
+	guint j = 0;
+	for (; j + 16 <= width; j += 16) {
+		interleave4_16_ssse3(dest + 4*j,
+			_mm_loadu_si128((const __m128i*) (r + j)),
+			_mm_loadu_si128((const __m128i*) (g + j)),
+			_mm_loadu_si128((const __m128i*) (b + j)),
+			_mm_loadu_si128((const __m128i*) (a + j)));
+	}
+	interleave_rgba8_scalar(dest + 4*j, r + j, g + j, b + j, a + j,
+		width - j);
+}
+
+/* Same as interleave_16_ssse3, for 32 samples. pshufb works within 128-bit
+   lanes, so each lane produces half of the output and the halves are then
+   put back in order. */
+__attribute__((target("avx2")))
+static inline void
+interleave_32_avx2 (guchar* dest, __m256i r, __m256i g, __m256i b)
+{
+	__m256i o[3];
+	int k;
+	for (k = 0; k < 3; k++) {
+		const __m128i* m = (const __m128i*) interleave_masks[3*k];
+		o[k] = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_shuffle_epi8(r,
+					_mm256_broadcastsi128_si256(_mm_load_si128(m + 0))),
+				_mm256_shuffle_epi8(g,
+					_mm256_broadcastsi128_si256(_mm_load_si128(m + 1)))),
+			_mm256_shuffle_epi8(b,
+				_mm256_broadcastsi128_si256(_mm_load_si128(m + 2))));
+	}
+	_mm256_storeu_si256((__m256i*) dest,
+		_mm256_permute2x128_si256(o[0], o[1], 0x20));
+	_mm256_storeu_si256((__m256i*) (dest + 32),
+		_mm256_permute2x128_si256(o[2], o[0], 0x30));
+	_mm256_storeu_si256((__m256i*) (dest + 64),
+		_mm256_permute2x128_si256(o[1], o[2], 0x31));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+narrow_32_avx2 (const guchar* src)
+{
+	const __m256i lo = _mm256_set1_epi16(0x00ff);
+	__m256i a = _mm256_and_si256(
+		_mm256_loadu_si256((const __m256i*) src), lo);
+	__m256i c = _mm256_and_si256(
+		_mm256_loadu_si256((const __m256i*) (src + 32)), lo);
+	/* packus interleaves lanes, permute restores sample order */
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, c), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static void
+narrow_high_avx2 (guchar* dest, const guchar* src, guint width,
+                  const guint16* bias)
+{
+	guint j = 0;
+	for (; j + 32 <= width; j += 32) {
+		_mm256_storeu_si256((__m256i*) (dest + j), narrow_32_avx2(src + 2*j));
+	}
+	narrow_high_ssse3(dest + j, src + 2*j, width - j, bias);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+div257_bias_avx2 (const guchar* src, __m256i bias)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i*) src);
+	v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+	v = _mm256_adds_epu16(v, bias);
+	return _mm256_srli_epi16(
+		_mm256_sub_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void
+narrow_bias_avx2 (guchar* dest, const guchar* src, guint width,
+                  const guint16* bias)
+{
+	__m256i b = _mm256_broadcastq_epi64(
+		_mm_loadl_epi64((const __m128i*) bias));
+	guint j = 0;
+
+	for (; j + 32 <= width; j += 32) {
+		/* packus interleaves lanes, permute restores sample order */
+		_mm256_storeu_si256((__m256i*) (dest + j), _mm256_permute4x64_epi64(
+			_mm256_packus_epi16(div257_bias_avx2(src + 2*j, b),
+				div257_bias_avx2(src + 2*j + 32, b)), 0xd8));
+	}
+	narrow_bias_ssse3(dest + j, src + 2*j, width - j, bias);
+}
+
+__attribute__((target("avx2")))
+static void
+interleave_rgb8_avx2 (guchar* dest, const guchar* r, const guchar* g,
+                      const guchar* b, guint width)
+{
+	guint j = 0;
+	for (; j + 32 <= width; j += 32) {
+		interleave_32_avx2(dest + 3*j,
+			_mm256_loadu_si256((const __m256i*) (r + j)),
+			_mm256_loadu_si256((const __m256i*) (g + j)),
+			_mm256_loadu_si256((const __m256i*) (b + j)));
+	}
+	interleave_rgb8_ssse3(dest + 3*j, r + j, g + j, b + j, width - j);
+}
+
+/* Same as interleave4_16_ssse3, for 32 samples. Unpacking works within
+   lanes, so the first lane holds pixels 0-7 and 16-23 and the second one
+   8-15 and 24-31 until they are swapped back. */
+__attribute__((target("avx2")))
+static inline void
+interleave4_32_avx2 (guchar* dest, __m256i r, __m256i g, __m256i b,
+                     __m256i a)
+{
+	__m256i rg_lo = _mm256_unpacklo_epi8(r, g);
+	__m256i rg_hi = _mm256_unpackhi_epi8(r, g);
+	__m256i ba_lo = _mm256_unpacklo_epi8(b, a);
+	__m256i ba_hi = _mm256_unpackhi_epi8(b, a);
+	__m256i o0 = _mm256_unpacklo_epi16(rg_lo, ba_lo);
+	__m256i o1 = _mm256_unpackhi_epi16(rg_lo, ba_lo);
+	__m256i o2 = _mm256_unpacklo_epi16(rg_hi, ba_hi);
+	__m256i o3 = _mm256_unpackhi_epi16(rg_hi, ba_hi);
+
+	_mm256_storeu_si256((__m256i*) dest,
+		_mm256_permute2x128_si256(o0, o1, 0x20));
+	_mm256_storeu_si256((__m256i*) (dest + 32),
+		_mm256_permute2x128_si256(o2, o3, 0x20));
+	_mm256_storeu_si256((__m256i*) (dest + 64),
+		_mm256_permute2x128_si256(o0, o1, 0x31));
+	_mm256_storeu_si256((__m256i*) (dest + 96),
+		_mm256_permute2x128_si256(o2, o3, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void
+interleave_rgba8_avx2 (guchar* dest, const guchar* r, const guchar* g,
+                       const guchar* b, const guchar* a, guint width)
+{
+	guint j = 0;
+	for (; j + 32 <= width; j += 32) {
+		interleave4_32_avx2(dest + 4*j,
+			_mm256_loadu_si256((const __m256i*) (r + j)),
+			_mm256_loadu_si256((const __m256i*) (g + j)),
+			_mm256_loadu_si256((const __m256i*) (b + j)),
+			_mm256_loadu_si256((const __m256i*) (a + j)));
+	}
+	interleave_rgba8_ssse3(dest + 4*j, r + j, g + j, b + j, a + j,
+		width - j);
+}
+
+#endif /* PSD_X86_SIMD */
+
+/*
+ * Accurate CMYK conversion.
+ *
+ * Colors of a 17x17x17x17 grid of CMYK values are computed once per
+ * process from a built-in model of press output and kept in a lookup
+ * table; pixels are then interpolated between the five nearest grid
+ * points (4D tetrahedral interpolation).
+ *
+ * The model mixes sRGB colors of the 16 Neugebauer primaries (paper,
+ * each ink and every overprint of them) with Demichel weights and the
+ * Yule-Nielsen correction, which is close to what a coated press
+ * (SWOP) profile gives. Embedded ICC profiles are not used.
+ */
+#define CMYK_LUT_GRID 17
+
+/* sRGB colors of inks on paper, indexed by C=1, M=2, Y=4 bit mask */
+static const guint8 cmyk_primaries[8][3] = {
+	{ 255, 255, 255 },
+	{   0, 174, 239 },
+	{ 236,   0, 140 },
+	{  46,  49, 146 },
+	{ 255, 242,   0 },
+	{   0, 166,  81 },
+	{ 237,  28,  36 },
+	{  54,  53,  55 }
+};
+
+/* sRGB color of black ink on paper */
+static const guint8 cmyk_black[3] = { 35, 31, 32 };
+
+static gdouble
+srgb_to_linear (gdouble v)
+{
+	return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static gdouble
+linear_to_srgb (gdouble v)
+{
+	return v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+/*
+ * Returns the grid, stored as 3 bytes per point in C, M, Y, K order
+ * (K varies fastest). One spare byte at the end lets kernels read grid
+ * points as 32-bit words.
+ */
+static const guint8*
+get_cmyk_lut (void)
+{
+	static guint8* lut;
+	static gsize initialized = 0;
+
+	if (g_once_init_enter(&initialized)) {
+		const guint n = CMYK_LUT_GRID;
+		gdouble prim[16][3];
+		guint8* p;
+		guint s, ch, c, m, y, k;
+
+		/* Yule-Nielsen n = 2: mix square roots of linear values */
+		for (s = 0; s < 16; s++) {
+			for (ch = 0; ch < 3; ch++) {
+				gdouble v = srgb_to_linear(cmyk_primaries[s & 7][ch] / 255.0);
+				if (s & 8) {
+					v *= srgb_to_linear(cmyk_black[ch] / 255.0);
+				}
+				prim[s][ch] = sqrt(v);
+			}
+		}
+
+		lut = g_malloc(n * n * n * n * 3 + 1);
+		p = lut;
+		for (c = 0; c < n; c++)
+		for (m = 0; m < n; m++)
+		for (y = 0; y < n; y++)
+		for (k = 0; k < n; k++) {
+			/* channels store 255 - ink, so grid point 0 is full ink */
+			gdouble ink[4];
+			gdouble sum[3] = { 0.0, 0.0, 0.0 };
+			ink[0] = 1.0 - (gdouble) c / (n - 1);
+			ink[1] = 1.0 - (gdouble) m / (n - 1);
+			ink[2] = 1.0 - (gdouble) y / (n - 1);
+			ink[3] = 1.0 - (gdouble) k / (n - 1);
+
+			for (s = 0; s < 16; s++) {
+				gdouble w = 1.0;
+				guint i;
+				for (i = 0; i < 4; i++) {
+					w *= (s & (1 << i)) ? ink[i] : 1.0 - ink[i];
+				}
+				for (ch = 0; ch < 3; ch++) {
+					sum[ch] += w * prim[s][ch];
+				}
+			}
+			for (ch = 0; ch < 3; ch++) {
+				gdouble v = linear_to_srgb(sum[ch] * sum[ch]);
+				*p++ = CLAMP(v * 255.0 + 0.5, 0.0, 255.0);
+			}
+		}
+		*p = 0;
+
+		g_once_init_leave(&initialized, 1);
+	}
+	return lut;
+}
+
+#define CMYK_LUT_STRIDE_K 3
+#define CMYK_LUT_STRIDE_Y (CMYK_LUT_STRIDE_K * CMYK_LUT_GRID)
+#define CMYK_LUT_STRIDE_M (CMYK_LUT_STRIDE_Y * CMYK_LUT_GRID)
+#define CMYK_LUT_STRIDE_C (CMYK_LUT_STRIDE_M * CMYK_LUT_GRID)
+
+/* splits a sample into grid cell and position inside it (0-255) */
+static inline void
+cmyk_lut_cell (guint v, guint* cell, guint* frac)
+{
+	guint pos = v * (CMYK_LUT_GRID - 1);
+	*cell = MIN(((pos + 1) * 257) >> 16, CMYK_LUT_GRID - 2);
+	*frac = pos - *cell * 255;
+}
+
+static inline void
+cmyk_lut_pixel (const guint8* lut, guchar* dest, guint k)
+{
+	guint cell[4], frac[4], key[4];
+	const guint stride[4] = {
+		CMYK_LUT_STRIDE_C, CMYK_LUT_STRIDE_M,
+		CMYK_LUT_STRIDE_Y, CMYK_LUT_STRIDE_K
+	};
+	const guint8 *v0, *v1, *v2, *v3, *v4;
+	guint i, ch;
+
+	cmyk_lut_cell(dest[0], &cell[0], &frac[0]);
+	cmyk_lut_cell(dest[1], &cell[1], &frac[1]);
+	cmyk_lut_cell(dest[2], &cell[2], &frac[2]);
+	cmyk_lut_cell(k, &cell[3], &frac[3]);
+
+	/* sort axes by position inside the cell, largest first; the key
+	   keeps the stride of the axis in its low bits */
+	for (i = 0; i < 4; i++) {
+		key[i] = (frac[i] << 20) | stride[i];
+	}
+#define SORT_DESC(a, b) \
+	if (key[a] < key[b]) { guint t = key[a]; key[a] = key[b]; key[b] = t; }
+	SORT_DESC(0, 1) SORT_DESC(2, 3) SORT_DESC(0, 2) SORT_DESC(1, 3)
+	SORT_DESC(1, 2)
+#undef SORT_DESC
+
+	v0 = lut + cell[0] * stride[0] + cell[1] * stride[1] +
+		cell[2] * stride[2] + cell[3] * stride[3];
+	v1 = v0 + (key[0] & 0xfffff);
+	v2 = v1 + (key[1] & 0xfffff);
+	v3 = v2 + (key[2] & 0xfffff);
+	v4 = v3 + (key[3] & 0xfffff);
+
+	for (ch = 0; ch < 3; ch++) {
+		guint sum = (255 - (key[0] >> 20)) * v0[ch]
+			+ ((key[0] >> 20) - (key[1] >> 20)) * v1[ch]
+			+ ((key[1] >> 20) - (key[2] >> 20)) * v2[ch]
+			+ ((key[2] >> 20) - (key[3] >> 20)) * v3[ch]
+			+ (key[3] >> 20) * v4[ch];
+		dest[ch] = div255(sum);
+	}
+}
+
+static void
+cmyk_lut8_scalar (guchar* dest, const guchar* k, guint width)
+{
+	const guint8* lut = get_cmyk_lut();
+	guint j;
+	for (j = 0; j < width; j++) {
+		cmyk_lut_pixel(lut, dest + 3*j, k[j]);
+	}
+}
+
+#ifdef PSD_X86_SIMD
+
+/* Same as cmyk_lut_pixel for 8 pixels. Grid points are fetched with
+   gathers, so dest must have at least one more byte after the 8 pixels. */
+__attribute__((target("avx2")))
+static inline void
+cmyk_lut_8_avx2 (const guint8* lut, guchar* dest, __m256i k)
+{
+	const __m256i ff = _mm256_set1_epi32(0xff);
+	const __m256i low = _mm256_set1_epi32(0xfffff);
+	const gint32 stride[4] = {
+		CMYK_LUT_STRIDE_C, CMYK_LUT_STRIDE_M,
+		CMYK_LUT_STRIDE_Y, CMYK_LUT_STRIDE_K
+	};
+	__m256i cmy = _mm256_i32gather_epi32((const int*) dest,
+		_mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21), 1);
+	__m256i v[4], key[4], w[5], g[5], o, rgb;
+	__m256i base = _mm256_setzero_si256();
+	guint8 out[32];
+	int i, ch;
+
+	v[0] = _mm256_and_si256(cmy, ff);
+	v[1] = _mm256_and_si256(_mm256_srli_epi32(cmy, 8), ff);
+	v[2] = _mm256_and_si256(_mm256_srli_epi32(cmy, 16), ff);
+	v[3] = k;
+
+	for (i = 0; i < 4; i++) {
+		__m256i s = _mm256_set1_epi32(stride[i]);
+		__m256i pos = _mm256_slli_epi32(v[i], 4);
+		__m256i cell = _mm256_min_epu32(_mm256_set1_epi32(CMYK_LUT_GRID - 2),
+			_mm256_srli_epi32(_mm256_mullo_epi32(
+				_mm256_add_epi32(pos, _mm256_set1_epi32(1)),
+				_mm256_set1_epi32(257)), 16));
+		__m256i frac = _mm256_sub_epi32(pos,
+			_mm256_mullo_epi32(cell, _mm256_set1_epi32(255)));
+		base = _mm256_add_epi32(base, _mm256_mullo_epi32(cell, s));
+		key[i] = _mm256_or_si256(_mm256_slli_epi32(frac, 20), s);
+	}
+
+#define SORT_DESC(a, b) { \
+	__m256i t = _mm256_max_epu32(key[a], key[b]); \
+	key[b] = _mm256_min_epu32(key[a], key[b]); \
+	key[a] = t; }
+	SORT_DESC(0, 1) SORT_DESC(2, 3) SORT_DESC(0, 2) SORT_DESC(1, 3)
+	SORT_DESC(1, 2)
+#undef SORT_DESC
+
+	o = base;
+	g[0] = _mm256_i32gather_epi32((const int*) lut, o, 1);
+	for (i = 0; i < 4; i++) {
+		o = _mm256_add_epi32(o, _mm256_and_si256(key[i], low));
+		g[i+1] = _mm256_i32gather_epi32((const int*) lut, o, 1);
+		key[i] = _mm256_srli_epi32(key[i], 20);
+	}
+	w[0] = _mm256_sub_epi32(ff, key[0]);
+	w[1] = _mm256_sub_epi32(key[0], key[1]);
+	w[2] = _mm256_sub_epi32(key[1], key[2]);
+	w[3] = _mm256_sub_epi32(key[2], key[3]);
+	w[4] = key[3];
+
+	rgb = _mm256_setzero_si256();
+	for (ch = 0; ch < 3; ch++) {
+		__m256i sum = _mm256_set1_epi32(128);
+		for (i = 0; i < 5; i++) {
+			sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(w[i],
+				_mm256_and_si256(_mm256_srli_epi32(g[i], 8 * ch), ff)));
+		}
+		sum = _mm256_srli_epi32(
+			_mm256_add_epi32(sum, _mm256_srli_epi32(sum, 8)), 8);
+		rgb = _mm256_or_si256(rgb, _mm256_slli_epi32(sum, 8 * ch));
+	}
+
+	/* drop the fourth byte of each pixel */
+	rgb = _mm256_shuffle_epi8(rgb, _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+	_mm256_storeu_si256((__m256i*) out, rgb);
+	memcpy(dest, out, 12);
+	memcpy(dest + 12, out + 16, 12);
+}
+
+__attribute__((target("avx2")))
+static void
+cmyk_lut8_avx2 (guchar* dest, const guchar* k, guint width)
+{
+	const guint8* lut = get_cmyk_lut();
+	guint j = 0;
+	for (; j + 8 < width; j += 8) {
+		cmyk_lut_8_avx2(lut, dest + 3*j, _mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((const __m128i*) (k + j))));
+	}
+	cmyk_lut8_scalar(dest + 3*j, k + j, width - j);
+}
+
+#endif /* PSD_X86_SIMD */
+
+/*
+ * Picks the best row kernels for this CPU, once per process.
+ */
+static const PsdRowKernels*
+get_row_kernels (void)
+{
+	static PsdRowKernels kernels;
+	static gsize initialized = 0;
+
+	if (g_once_init_enter(&initialized)) {
+		guint k, v;
+		for (k = 0; k < 256; k++) {
+			for (v = 0; v < 256; v++) {
+				mul_table[k][v] = mul_div255(v, k);
+			}
+		}
+
+		kernels.narrow_high = narrow_high_scalar;
+		kernels.narrow_bias = narrow_bias_scalar;
+		kernels.rgb8 = interleave_rgb8_scalar;
+		kernels.rgba8 = interleave_rgba8_scalar;
+		kernels.apply_k8 = apply_k8_scalar;
+		kernels.cmyk_lut8 = cmyk_lut8_scalar;
+#ifdef PSD_X86_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("ssse3")) {
+			kernels.narrow_high = narrow_high_ssse3;
+			kernels.narrow_bias = narrow_bias_ssse3;
+			kernels.rgb8 = interleave_rgb8_ssse3;
+			kernels.rgba8 = interleave_rgba8_ssse3;
+			kernels.apply_k8 = apply_k8_ssse3;
+		}
+		if (__builtin_cpu_supports("avx2")) {
+			kernels.narrow_high = narrow_high_avx2;
+			kernels.narrow_bias = narrow_bias_avx2;
+			kernels.rgb8 = interleave_rgb8_avx2;
+			kernels.rgba8 = interleave_rgba8_avx2;
+			kernels.cmyk_lut8 = cmyk_lut8_avx2;
+		}
+#endif
+		g_once_init_leave(&initialized, 1);
+	}
+	return &kernels;
+}
+
+/*
+ * Returns kernel that converts CMYK rows with current settings.
+ */
+static ApplyKFunc
+get_cmyk_kernel (void)
+{
+	const PsdRowKernels* kernels = get_row_kernels();
+
+	if (g_atomic_int_get(&cmyk_conversion) == GDK_PIXBUF_PSD_CMYK_NAIVE) {
+		return kernels->apply_k8;
+	}
+	return kernels->cmyk_lut8;
+}
+
+/*
+ * Picks the kernel that narrows 16-bit rows with current settings.
+ */
+static void
+set_narrow_kernel (PsdContext* ctx)
+{
+	const PsdRowKernels* kernels = get_row_kernels();
+
+	switch (g_atomic_int_get(&sample_conversion)) {
+		case GDK_PIXBUF_PSD_16BIT_ROUND:
+			ctx->narrow = kernels->narrow_bias;
+			ctx->narrow_bias = round_bias;
+			break;
+		case GDK_PIXBUF_PSD_16BIT_DITHER:
+			ctx->narrow = kernels->narrow_bias;
+			ctx->narrow_bias = dither_bias;
+			break;
+		default:
+			ctx->narrow = kernels->narrow_high;
+			ctx->narrow_bias = round_bias;
+			break;
+	}
+}
+
+/*
+ * Returns number of channels that make up the composite image in given
+ * color mode. Remaining channels (alpha, spot colors) are not displayed,
+ * except for transparency of the composite image (see has_alpha).
+ */
+static guint
+color_mode_channels (PsdColorMode mode)
+{
+	switch (mode) {
+		case PSD_MODE_RGB:
+			return 3;
+		case PSD_MODE_CMYK:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+/* Returns number of channels we decode: color ones and transparency */
+static guint
+decoded_channels (PsdContext* ctx)
+{
+	return color_mode_channels(ctx->color_mode) + (ctx->has_alpha ? 1 : 0);
+}
+
+/*
+ * Applies K to C, M and Y packed in RGBA. CMYK kernels work on RGB, so
+ * pixels go through a small RGB buffer on the stack.
+ */
+static void
+apply_k_rgba (PsdContext* ctx, guchar* dest, const guchar* k)
+{
+	guchar rgb[3 * 256];
+	guint j, i, n;
+
+	for (j = 0; j < ctx->out_width; j += n) {
+		n = MIN(ctx->out_width - j, 256);
+		for (i = 0; i < n; i++) {
+			rgb[3*i+0] = dest[4*(j+i)+0];
+			rgb[3*i+1] = dest[4*(j+i)+1];
+			rgb[3*i+2] = dest[4*(j+i)+2];
+		}
+		ctx->apply_k(rgb, k + j, n);
+		for (i = 0; i < n; i++) {
+			dest[4*(j+i)+0] = rgb[3*i+0];
+			dest[4*(j+i)+1] = rgb[3*i+1];
+			dest[4*(j+i)+2] = rgb[3*i+2];
+		}
+	}
+}
+
+/*
+ * Narrows 16-bit samples of source row y to 8 bits in dest, which may be
+ * src. Only columns of the decoded region are converted, starting at a
+ * multiple of 4 so that dithering does not depend on the region.
+ */
+static void
+narrow_row (PsdContext* ctx, guchar* dest, const guchar* src, guint y)
+{
+	guint x = ctx->scaled ? 0 : ctx->x0 & ~3u;
+	guint end = ctx->scaled ? ctx->width : ctx->x0 + ctx->out_width;
+
+	ctx->narrow(dest + x, src + 2*x, end - x, ctx->narrow_bias[y & 3]);
+}
+
+/*
+ * Stores one decoded channel row directly in its interleaved slot of
+ * the pixbuf, so we never need to keep whole channels in memory.
+ *
+ * Rows are 8-bit; 16-bit ones are narrowed by narrow_row() first.
+ */
+static void
+store_channel_row (PsdContext* ctx, guint ch, guint row, const guchar* src)
+{
+	guchar* dest = gdk_pixbuf_get_pixels(ctx->pixbuf)
+		+ (gsize) row * gdk_pixbuf_get_rowstride(ctx->pixbuf);
+	guint n = ctx->has_alpha ? 4 : 3;
+	guint j;
+
+	if (ch == color_mode_channels(ctx->color_mode)) {
+		/* transparency */
+		dest += 3;
+		for (j = 0; j < ctx->out_width; j++) {
+			dest[n*j] = src[j];
+		}
+	} else if (ctx->color_mode == PSD_MODE_GRAYSCALE ||
+	    ctx->color_mode == PSD_MODE_DUOTONE)
+	{
+		for (j = 0; j < ctx->out_width; j++) {
+			dest[n*j+0] = dest[n*j+1] = dest[n*j+2] = src[j];
+		}
+	} else if (ch == 0 && ctx->preview) {
+		/* R or C, shown as grayscale until the other channels arrive */
+		for (j = 0; j < ctx->out_width; j++) {
+			dest[n*j+0] = dest[n*j+1] = dest[n*j+2] = src[j];
+		}
+	} else if (ch < 3) {
+		/* R, G, B or C, M, Y */
+		dest += ch;
+		for (j = 0; j < ctx->out_width; j++) {
+			dest[n*j] = src[j];
+		}
+	} else if (ctx->has_alpha) {
+		apply_k_rgba(ctx, dest, src);
+	} else {
+		/* CMYK: C, M and Y are already in place, apply K */
+		ctx->apply_k(dest, src, ctx->out_width);
+	}
+}
+
+/*
+ * Packs planar rows of all decoded channels into one row of the pixbuf.
+ */
+static void
+pack_row (PsdContext* ctx, guint row, const guchar** planes)
+{
+	const PsdRowKernels* kernels = get_row_kernels();
+	guchar* dest = gdk_pixbuf_get_pixels(ctx->pixbuf)
+		+ (gsize) row * gdk_pixbuf_get_rowstride(ctx->pixbuf);
+	guint n = color_mode_channels(ctx->color_mode);
+	const guchar* r = planes[0];
+	const guchar* g = n > 1 ? planes[1] : planes[0];
+	const guchar* bl = n > 1 ? planes[2] : planes[0];
+
+	if (ctx->has_alpha) {
+		kernels->rgba8(dest, r, g, bl, planes[n], ctx->out_width);
+	} else {
+		kernels->rgb8(dest, r, g, bl, ctx->out_width);
+	}
+	if (ctx->color_mode == PSD_MODE_CMYK) {
+		store_channel_row(ctx, 3, row, planes[3]);
+	}
+}
+
+/*
+ * Returns an empty block of at least size bytes, the smallest one that
+ * fits from the pool or a new one. Returns NULL if there is not enough
+ * memory.
+ */
+static PsdArena*
+pool_take (gsize size)
+{
+	PsdArena** best = NULL;
+	PsdArena** p;
+	PsdArena* block = NULL;
+
+	g_mutex_lock(&pool_lock);
+	for (p = &pool_blocks; *p != NULL; p = &(*p)->next) {
+		/* a much larger block is left for the load it was sized for */
+		if ((*p)->size >= size && (*p)->size / 2 <= size &&
+		    (best == NULL || (*p)->size < (*best)->size))
+		{
+			best = p;
+		}
+	}
+	if (best != NULL) {
+		block = *best;
+		*best = block->next;
+		pool_size -= block->size;
+	}
+	g_mutex_unlock(&pool_lock);
+
+	if (block == NULL) {
+		block = g_try_malloc(sizeof(PsdArena) + PSD_ARENA_ALIGN + size);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->data = (guchar*) (((gsize) (block + 1) + PSD_ARENA_ALIGN - 1)
+			& ~(gsize) (PSD_ARENA_ALIGN - 1));
+		block->size = size;
+	}
+	block->next = NULL;
+	block->used = 0;
+	return block;
+}
+
+/* returns block to the pool, or frees it if the pool is full */
+static void
+pool_give (PsdArena* block)
+{
+	g_mutex_lock(&pool_lock);
+	if (pool_size + block->size <= pool_max_size) {
+		block->next = pool_blocks;
+		pool_blocks = block;
+		pool_size += block->size;
+		block = NULL;
+	}
+	g_mutex_unlock(&pool_lock);
+
+	g_free(block);
+}
+
+static PsdContext*
+pool_take_context (void)
+{
+	PsdContext* ctx = NULL;
+
+	g_mutex_lock(&pool_lock);
+	if (pool_n_contexts > 0) {
+		ctx = pool_contexts[--pool_n_contexts];
+	}
+	g_mutex_unlock(&pool_lock);
+
+	return ctx != NULL ? ctx : g_try_new(PsdContext, 1);
+}
+
+static void
+pool_give_context (PsdContext* ctx)
+{
+	g_mutex_lock(&pool_lock);
+	if (pool_max_size > 0 && pool_n_contexts < PSD_POOL_MAX_CONTEXTS) {
+		pool_contexts[pool_n_contexts++] = ctx;
+		ctx = NULL;
+	}
+	g_mutex_unlock(&pool_lock);
+
+	g_free(ctx);
+}
+
+/* rounds size up to arena alignment */
+#define PSD_ARENA_ROUND(size) \
+	(((size) + PSD_ARENA_ALIGN - 1) & ~(gsize) (PSD_ARENA_ALIGN - 1))
+
+/*
+ * Returns size of all working buffers the load may need, known once the
+ * header and compression type are read.
+ */
+static gsize
+arena_size (PsdContext* ctx)
+{
+	gsize size = PSD_ARENA_ROUND((gsize) ctx->width * ctx->depth_bytes);
+
+	if (ctx->compression == PSD_COMPRESSION_RLE) {
+		size += PSD_ARENA_ROUND(sizeof(guint32) *
+			ctx->channels * ctx->height);
+	}
+	if (ctx->scaled) {
+		size += PSD_ARENA_ROUND((ctx->out_width + 1) * sizeof(guint));
+		size += PSD_ARENA_ROUND(ctx->out_width * sizeof(guint32));
+		size += PSD_ARENA_ROUND(ctx->out_width);
+	}
+	return size;
+}
+
+/*
+ * Returns size bytes of working memory aligned to PSD_ARENA_ALIGN, or
+ * NULL if there is not enough memory. The first block is large enough
+ * for everything arena_size() counts, so one block is usually all a load
+ * takes, and blocks come from the pool when a similar image was loaded
+ * before.
+ */
+static gpointer
+arena_alloc (PsdContext* ctx, gsize size)
+{
+	PsdArena* block = ctx->arena;
+	gpointer p;
+
+	size = PSD_ARENA_ROUND(MAX(size, 1));
+	if (block == NULL || size > block->size - block->used) {
+		block = pool_take(block == NULL ? MAX(size, arena_size(ctx)) : size);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->next = ctx->arena;
+		ctx->arena = block;
+	}
+
+	p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+static void
+arena_free (PsdContext* ctx)
+{
+	while (ctx->arena != NULL) {
+		PsdArena* next = ctx->arena->next;
+		pool_give(ctx->arena);
+		ctx->arena = next;
+	}
+}
+
+/*
+ * Returns bytes that decoding to out_width x out_height is expected to
+ * take, estimated from the header alone: the pixbuf, line lengths and
+ * row buffers.
+ */
+static guint64
+load_cost (PsdContext* ctx, guint out_width, guint out_height)
+{
+	/* transparency is not known yet, assume any extra channel is */
+	guint n = ctx->channels > color_mode_channels(ctx->color_mode) ? 4 : 3;
+	guint64 cost = (((guint64) out_width * n + 3) & ~3) * out_height;
+
+	cost += sizeof(guint32) * (guint64) ctx->channels * ctx->height;
+	cost += (guint64) ctx->width * ctx->depth_bytes * (PSD_MAX_PLANES + 1);
+	return cost;
+}
+
+/*
+ * Charges cost bytes to the load if they fit in the budgets.
+ */
+static gboolean
+charge_budget (PsdContext* ctx, guint64 cost)
+{
+	gboolean fits;
+
+	g_mutex_lock(&budget_lock);
+	fits = (load_budget == 0 || ctx->charged + cost <= load_budget) &&
+		(total_budget == 0 || budget_used + cost <= total_budget);
+	if (fits) {
+		budget_used += cost;
+		ctx->charged += cost;
+	}
+	g_mutex_unlock(&budget_lock);
+	return fits;
+}
+
+static void
+release_budget (PsdContext* ctx)
+{
+	g_mutex_lock(&budget_lock);
+	budget_used -= ctx->charged;
+	ctx->charged = 0;
+	g_mutex_unlock(&budget_lock);
+}
+
+/*
+ * Charges decoding to *out_width x *out_height, scaling the size down
+ * while keeping the aspect ratio until it fits in the budgets, so large
+ * images come out smaller instead of failing.
+ *
+ * Returns false if not even one pixel fits.
+ */
+static gboolean
+fit_budget (PsdContext* ctx, guint* out_width, guint* out_height)
+{
+	while (!charge_budget(ctx, load_cost(ctx, *out_width, *out_height))) {
+		if (*out_width == 1 && *out_height == 1) {
+			return FALSE;
+		}
+		*out_width = MAX(*out_width / 8 * 7, 1);
+		*out_height = MAX(*out_height / 8 * 7, 1);
+	}
+	return TRUE;
+}
+
+/*
+ * Returns size of channel data we decode, which follows the compression
+ * type (and the line lengths table for RLE). Channels that are not
+ * displayed come last and are never read.
+ */
+static guint64
+channel_data_size (PsdContext* ctx)
+{
+	guint n = decoded_channels(ctx);
+	guint64 total = 0;
+	guint i;
+
+	if (ctx->compression == PSD_COMPRESSION_RLE) {
+		for (i = 0; i < ctx->height * n; i++) {
+			total += ctx->lines_lengths[i];
+		}
+	} else {
+		total = (guint64) ctx->width * ctx->height * ctx->depth_bytes * n;
+	}
+	return total;
+}
+
+/* source rows averaged into one row of a scaled image; the rest of
+   them are skipped without decoding */
+#define PSD_SCALE_TAPS 2
+
+/* first source row covered by output row y */
+static inline guint
+scale_row_start (PsdContext* ctx, guint y)
+{
+	if (!ctx->scaled) {
+		return ctx->y0 + y;
+	}
+	return (guint64) y * ctx->height / ctx->out_height;
+}
+
+static inline guint
+scale_row_taps (PsdContext* ctx, guint y)
+{
+	return MIN(scale_row_start(ctx, y + 1) - scale_row_start(ctx, y),
+		PSD_SCALE_TAPS);
+}
+
+/* source row used as tap t of output row y, spread evenly over its span */
+static inline guint
+scale_tap_row (PsdContext* ctx, guint y, guint t)
+{
+	guint start = scale_row_start(ctx, y);
+	guint span = scale_row_start(ctx, y + 1) - start;
+	guint taps = MIN(span, PSD_SCALE_TAPS);
+
+	return start + (2 * t + 1) * span / (2 * taps);
+}
+
+/* adds box-filtered columns of an 8-bit source channel row to acc */
+static void
+scale_add_row (PsdContext* ctx, guint32* acc, const guchar* src)
+{
+	guint x, j;
+
+	for (x = 0; x < ctx->out_width; x++) {
+		guint32 sum = 0;
+		for (j = ctx->col_start[x]; j < ctx->col_start[x + 1]; j++) {
+			sum += src[j];
+		}
+		acc[x] += sum;
+	}
+}
+
+/* turns sums of taps rows into an 8-bit row and clears them */
+static void
+scale_finish_row (PsdContext* ctx, guint32* acc, guchar* dest, guint taps)
+{
+	guint x;
+
+	for (x = 0; x < ctx->out_width; x++) {
+		guint32 n = taps * (ctx->col_start[x + 1] - ctx->col_start[x]);
+		dest[x] = (acc[x] + n / 2) / n;
+		acc[x] = 0;
+	}
+}
+
+/* checks that a row of RLE data decodes to row_bytes of 0xff */
+static gboolean
+rle_row_is_opaque (const guchar* src, gsize src_len, gsize row_bytes)
+{
+	const guchar* end = src + src_len;
+	gsize total = 0;
+
+	while (src < end) {
+		gint byte = (gint8) *src++;
+
+		if (byte >= 0) {
+			gsize count = byte + 1;
+			if (count > (gsize) (end - src)) {
+				return FALSE;
+			}
+			total += count;
+			while (count-- > 0) {
+				if (*src++ != 0xff) {
+					return FALSE;
+				}
+			}
+		} else if (byte != -128) {
+			if (src == end || *src++ != 0xff) {
+				return FALSE;
+			}
+			total += -byte + 1;
+		}
+	}
+	return total == row_bytes;
+}
+
+/*
+ * Checks in one pass over the transparency channel, without decoding
+ * it, whether all rows we decode are fully opaque. Then the image can
+ * go to a cheaper RGB pixbuf.
+ */
+static gboolean
+alpha_is_opaque (PsdContext* ctx, const guchar* data)
+{
+	guint n = color_mode_channels(ctx->color_mode);
+	gsize row_bytes = (gsize) ctx->width * ctx->depth_bytes;
+	guint first = scale_row_start(ctx, 0);
+	guint last = scale_row_start(ctx, ctx->out_height);
+	guint i;
+
+	if (ctx->compression == PSD_COMPRESSION_RLE) {
+		const guint32* lengths = ctx->lines_lengths + n * ctx->height;
+		for (i = 0; i < n * ctx->height + first; i++) {
+			data += ctx->lines_lengths[i];
+		}
+		for (i = first; i < last; i++) {
+			if (!rle_row_is_opaque(data, lengths[i], row_bytes)) {
+				return FALSE;
+			}
+			data += lengths[i];
+		}
+	} else {
+		const guchar* end = data + (n * ctx->height + last) * row_bytes;
+		data += (n * ctx->height + first) * row_bytes;
+		for (; data < end; data++) {
+			if (*data != 0xff) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Returns source row y of a channel as 8-bit samples, src pointing at its
+ * len bytes of data. RLE rows are decompressed to line and 16-bit rows are
+ * narrowed to plane, which may be line; other rows are used in place.
+ *
+ * Returns NULL if RLE data is corrupted.
+ */
+static const guchar*
+read_row (PsdContext*   ctx,
+          const guchar* src,
+          guint         len,
+          guint         y,
+          guchar*       line,
+          guchar*       plane)
+{
+	if (ctx->compression == PSD_COMPRESSION_RLE) {
+		guchar* out = ctx->depth_bytes == 2 ? line : plane;
+
+		if (!decompress_line(src, len, out,
+				(gsize) ctx->width * ctx->depth_bytes))
+		{
+			return NULL;
+		}
+		src = out;
+	}
+	if (ctx->depth_bytes == 2) {
+		narrow_row(ctx, plane, src, y);
+		return plane;
+	}
+	return src;
+}
+
+/*
+ * Decodes output rows first to last - 1 of a scaled image, src pointing
+ * at source row scale_row_start(first) in each channel, or, if packed,
+ * at only the rows scale_tap_row() picks, back to back. Each channel row
+ * is reduced separately and the results are interleaved like full rows.
+ *
+ * scratch holds the sums, one source row and n reduced rows.
+ *
+ * Returns false if RLE data is corrupted.
+ */
+static gboolean
+reduce_rows (PsdContext*    ctx,
+             const guchar** src,
+             guint          first,
+             guint          last,
+             guchar*        scratch,
+             gboolean       packed)
+{
+	guint n = decoded_channels(ctx);
+	gsize row_bytes = (gsize) ctx->width * ctx->depth_bytes;
+	guint32* acc = (guint32*) scratch;
+	guchar* line = scratch + ctx->out_width * sizeof(guint32);
+	guchar* planes = line + row_bytes;
+	const guchar* plane_rows[PSD_MAX_PLANES];
+	guint row[PSD_MAX_PLANES];
+	guint c, y, t;
+
+	memset(acc, 0, ctx->out_width * sizeof(guint32));
+	for (c = 0; c < n; c++) {
+		row[c] = scale_row_start(ctx, first);
+		plane_rows[c] = planes + c * ctx->out_width;
+	}
+
+	for (y = first; y < last; y++) {
+		guint taps = scale_row_taps(ctx, y);
+
+		for (c = 0; c < n; c++) {
+			guchar* plane = planes + c * ctx->out_width;
+
+			for (t = 0; t < taps; t++) {
+				guint r = scale_tap_row(ctx, y, t);
+				guint len = row_bytes;
+				const guchar* samples;
+
+				if (ctx->compression == PSD_COMPRESSION_RLE) {
+					const guint32* lengths =
+						ctx->lines_lengths + c * ctx->height;
+
+					for (; row[c] < r && !packed; row[c]++) {
+						src[c] += lengths[row[c]];
+					}
+					len = lengths[r];
+				} else if (!packed) {
+					src[c] += (r - row[c]) * row_bytes;
+				}
+				samples = read_row(ctx, src[c], len, r, line, line);
+				if (samples == NULL) {
+					return FALSE;
+				}
+				scale_add_row(ctx, acc, samples);
+				src[c] += len;
+				row[c] = r + 1;
+			}
+			scale_finish_row(ctx, acc, plane, taps);
+		}
+
+		pack_row(ctx, y, plane_rows);
+	}
+	return TRUE;
+}
+
+static gboolean
+decode_rows_scaled (PsdContext*    ctx,
+                    const guchar** src,
+                    guint          first,
+                    guint          last,
+                    guchar*        scratch)
+{
+	return reduce_rows(ctx, src, first, last, scratch, FALSE);
+}
+
+/*
+ * Decodes rows first to last - 1 of the pixbuf in row-major order, src
+ * pointing at the matching source rows (offset by y0) in each channel.
+ *
+ * scratch holds an 8-bit row of each channel and, for 16-bit RLE data,
+ * one decompressed source row.
+ *
+ * Returns false if RLE data is corrupted.
+ */
+static gboolean
+decode_rows (PsdContext*    ctx,
+             const guchar** src,
+             guint          first,
+             guint          last,
+             guchar*        scratch)
+{
+	guint n = decoded_channels(ctx);
+	gsize row_bytes = (gsize) ctx->width * ctx->depth_bytes;
+	guchar* line = scratch + n * ctx->width;
+	const guchar* planes[PSD_MAX_PLANES];
+	guint c, i;
+
+	for (i = first; i < last; i++) {
+		guint y = ctx->y0 + i;
+
+		for (c = 0; c < n; c++) {
+			guint len = ctx->compression == PSD_COMPRESSION_RLE
+				? ctx->lines_lengths[c * ctx->height + y] : row_bytes;
+			const guchar* samples = read_row(ctx, src[c], len, y, line,
+				scratch + c * ctx->width);
+
+			if (samples == NULL) {
+				return FALSE;
+			}
+			planes[c] = samples + ctx->x0;
+			src[c] += len;
+		}
+		pack_row(ctx, i, planes);
+	}
+	return TRUE;
+}
+
+/* images smaller than this are decoded by one thread; rows are always
+   decompressed in full, so this counts source columns and output rows */
+#define PSD_THREADED_MIN_PIXELS (1024 * 1024)
+#define PSD_MAX_THREADS 16
+/* rows taken by a thread at once */
+#define PSD_BAND_ROWS 32
+
+/* buffered decoding shared by all threads working on one image; helpers
+   still queued when the caller is done find it closed and leave */
+typedef struct
+{
+	PsdContext*   ctx;
+	const guchar* data;
+	const gsize*  offsets;        /* start of each band in each channel */
+	guint         n_bands;        /* bands of output rows */
+	gint          next_band;
+	gint          failed;
+	gint          nomem;          /* failed for lack of memory */
+	gint          ref_count;      /* caller and queued or running helpers */
+	guint         active;         /* helper threads decoding bands */
+	gboolean      closed;         /* no helper may start any more */
+	GMutex        lock;
+	GCond         cond;
+} PsdBufferedJob;
+
+/* Returns size of scratch decode_rows() needs, 0 if none */
+static gsize
+rows_scratch_size (PsdContext* ctx)
+{
+	gsize size = 0;
+
+	if (ctx->compression == PSD_COMPRESSION_RLE || ctx->depth_bytes == 2) {
+		/* samples are kept at 8 bits, like in 8-bit images */
+		size = decoded_channels(ctx) * (gsize) ctx->width;
+		if (ctx->compression == PSD_COMPRESSION_RLE &&
+		    ctx->depth_bytes == 2)
+		{
+			size += (gsize) ctx->width * ctx->depth_bytes;
+		}
+	}
+	return size;
+}
+
+/* Returns size of scratch decode_rows_scaled() or decode_rows() needs */
+static gsize
+bands_scratch_size (PsdContext* ctx)
+{
+	if (ctx->scaled) {
+		return ctx->out_width * (sizeof(guint32) + decoded_channels(ctx)) +
+			(gsize) ctx->width * ctx->depth_bytes;
+	}
+	return rows_scratch_size(ctx);
+}
+
+/*
+ * Decodes bands of the job until none are left. A helper without memory
+ * for its scratch leaves the bands to the others.
+ */
+static void
+decode_bands (PsdBufferedJob* job, gboolean helper)
+{
+	PsdContext* ctx = job->ctx;
+	guint n = decoded_channels(ctx);
+	gsize size;
+	PsdArena* block = NULL;
+	guchar* scratch = NULL;
+	gint band;
+
+	size = bands_scratch_size(ctx);
+	if (size > 0) {
+		block = pool_take(size);
+		if (block == NULL) {
+			if (!helper) {
+				g_atomic_int_set(&job->nomem, TRUE);
+				g_atomic_int_set(&job->failed, TRUE);
+			}
+			return;
+		}
+		scratch = block->data;
+	}
+
+	while (!g_atomic_int_get(&job->failed)) {
+		const guchar* src[PSD_MAX_PLANES];
+		guint c;
+
+		band = g_atomic_int_add(&job->next_band, 1);
+		if (band >= (gint) job->n_bands) {
+			break;
+		}
+		for (c = 0; c < n; c++) {
+			src[c] = job->data + job->offsets[band * n + c];
+		}
+		if (!(ctx->scaled ? decode_rows_scaled : decode_rows)(ctx, src,
+				band * PSD_BAND_ROWS,
+				MIN((band + 1) * PSD_BAND_ROWS, ctx->out_height), scratch))
+		{
+			g_atomic_int_set(&job->failed, TRUE);
+		}
+	}
+
+	if (block != NULL) {
+		pool_give(block);
+	}
+}
+
+static void
+job_unref (PsdBufferedJob* job)
+{
+	if (g_atomic_int_dec_and_test(&job->ref_count)) {
+		g_cond_clear(&job->cond);
+		g_mutex_clear(&job->lock);
+		g_free(job);
+	}
+}
+
+static void
+decode_bands_thread (gpointer data, gpointer user_data)
+{
+	PsdBufferedJob* job = (PsdBufferedJob*) data;
+	gboolean closed;
+
+	g_mutex_lock(&job->lock);
+	closed = job->closed;
+	if (!closed) {
+		job->active++;
+	}
+	g_mutex_unlock(&job->lock);
+
+	if (!closed) {
+		decode_bands(job, TRUE);
+
+		g_mutex_lock(&job->lock);
+		if (--job->active == 0) {
+			g_cond_signal(&job->cond);
+		}
+		g_mutex_unlock(&job->lock);
+	}
+	job_unref(job);
+}
+
+/*
+ * Returns pool of threads helping with buffered decoding, shared by all
+ * loads in the process, or NULL if threads are not available.
+ */
+static GThreadPool*
+get_thread_pool (void)
+{
+	static GThreadPool* pool;
+	static gsize initialized = 0;
+
+	if (g_once_init_enter(&initialized)) {
+		pool = g_thread_pool_new(decode_bands_thread, NULL,
+			MIN(g_get_num_processors(), PSD_MAX_THREADS), FALSE, NULL);
+		g_once_init_leave(&initialized, 1);
+	}
+	return pool;
+}
+
+/*
+ * Decodes the whole image in row-major order.
+ *
+ * Used when all channel data is already in memory: then we can find the
+ * current row of every channel and convert rows with the interleaving
+ * kernels instead of scattering each channel into the pixbuf separately.
+ * Uncompressed rows are read in place.
+ *
+ * Every row can be found from the line lengths, so large images are cut
+ * in bands of rows decoded in parallel by the calling thread and the
+ * shared thread pool. Scaled images skip rows that are not sampled, and
+ * regions skip rows and columns outside of them.
+ *
+ * Returns false with error set if RLE data is corrupted or memory for
+ * working buffers is short.
+ */
+static gboolean
+decode_buffered (PsdContext* ctx, const guchar* data, GError** error)
+{
+	PsdBufferedJob* job;
+	GThreadPool* pool = NULL;
+	guint n = decoded_channels(ctx);
+	gsize row_bytes = (gsize) ctx->width * ctx->depth_bytes;
+	PsdArena* block;
+	gsize* offsets;
+	gsize pos = 0;
+	guint n_bands = (ctx->out_height + PSD_BAND_ROWS - 1) / PSD_BAND_ROWS;
+	guint threads = 1;
+	guint c, i;
+	gboolean ok;
+
+	/* prefix sums of line lengths at every band start */
+	block = pool_take(n_bands * n * sizeof(gsize));
+	if (block == NULL) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			("Insufficient memory to load PSD image file"));
+		return FALSE;
+	}
+	offsets = (gsize*) block->data;
+	for (c = 0; c < n; c++) {
+		guint band = 0;
+		for (i = 0; i < ctx->height; i++) {
+			if (band < n_bands &&
+			    i == scale_row_start(ctx, band * PSD_BAND_ROWS))
+			{
+				offsets[band++ * n + c] = pos;
+			}
+			if (ctx->compression == PSD_COMPRESSION_RLE) {
+				pos += ctx->lines_lengths[c * ctx->height + i];
+			} else {
+				pos += row_bytes;
+			}
+		}
+	}
+
+	/* on the heap, helpers queued behind other loads may outlive the call */
+	job = g_new0(PsdBufferedJob, 1);
+	job->ctx = ctx;
+	job->data = data;
+	job->offsets = offsets;
+	job->n_bands = n_bands;
+	job->ref_count = 1;
+	g_mutex_init(&job->lock);
+	g_cond_init(&job->cond);
+
+	if ((gsize) ctx->width * ctx->out_height >= PSD_THREADED_MIN_PIXELS) {
+		pool = get_thread_pool();
+		threads = MIN(g_get_num_processors(), PSD_MAX_THREADS);
+		threads = MIN(threads, n_bands);
+	}
+	if (pool != NULL) {
+		for (i = 1; i < threads; i++) {
+			g_atomic_int_inc(&job->ref_count);
+			if (!g_thread_pool_push(pool, job, NULL)) {
+				g_atomic_int_add(&job->ref_count, -1);
+			}
+		}
+	}
+
+	decode_bands(job, FALSE);
+
+	/* every band is taken, wait only for helpers still decoding theirs */
+	g_mutex_lock(&job->lock);
+	job->closed = TRUE;
+	while (job->active > 0) {
+		g_cond_wait(&job->cond, &job->lock);
+	}
+	g_mutex_unlock(&job->lock);
+
+	ok = !g_atomic_int_get(&job->failed);
+	if (!ok) {
+		if (g_atomic_int_get(&job->nomem)) {
+			g_set_error (error, GDK_PIXBUF_ERROR,
+				GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+				("Insufficient memory to load PSD image file"));
+		} else {
+			g_set_error (error, GDK_PIXBUF_ERROR,
+				GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+				("Corrupted RLE data"));
+		}
+	}
+	job_unref(job);
+	pool_give(block);
+	return ok;
+}
+
+/*
+ * Reads the header from buf, at least PSD_HEADER_SIZE long, and checks
+ * only what walking the sections relies on: the version, channel count
+ * and dimensions.
+ */
+static gboolean
+read_file_header (PsdContext* ctx, const guchar* buf, GError** error)
+{
+	PsdHeader hd = psd_parse_header(buf);
+
+	if (hd.version != 1 && hd.version != 2) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+			("Unsupported PSD file version"));
+		return FALSE;
+	}
+	ctx->psb = hd.version == 2;
+	ctx->width = hd.columns;
+	ctx->height = hd.rows;
+	ctx->channels = hd.channels;
+	ctx->depth = hd.depth;
+	ctx->depth_bytes = (ctx->depth/8 > 0 ? ctx->depth/8 : 1);
+	ctx->color_mode = hd.color_mode;
+
+	if (ctx->channels > PSD_MAX_CHANNELS) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			("Too many channels"));
+		return FALSE;
+	}
+
+	if (ctx->width > (ctx->psb ? PSB_MAX_DIMENSION : PSD_MAX_DIMENSION) ||
+	    ctx->height > (ctx->psb ? PSB_MAX_DIMENSION : PSD_MAX_DIMENSION))
+	{
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			("Image dimensions are too large"));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Checks that we can decode the image of a header read by
+ * read_file_header.
+ */
+static gboolean
+check_decodable (PsdContext* ctx, GError** error)
+{
+	if (ctx->color_mode != PSD_MODE_RGB
+	    && ctx->color_mode != PSD_MODE_GRAYSCALE
+	    && ctx->color_mode != PSD_MODE_CMYK
+	    && ctx->color_mode != PSD_MODE_DUOTONE
+	) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+			("Unsupported color mode"));
+		return FALSE;
+	}
+	
+	if (ctx->depth != 8 && ctx->depth != 16) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+			("Unsupported color depth"));
+		return FALSE;
+	}
+	if (ctx->depth == 16) {
+		set_narrow_kernel(ctx);
+	}
+
+	if (ctx->channels < color_mode_channels(ctx->color_mode)) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			("Not enough color channels"));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Reads the header from buf, at least PSD_HEADER_SIZE long, and checks
+ * that we can decode the image.
+ */
+static gboolean
+read_header (PsdContext* ctx, const guchar* buf, GError** error)
+{
+	return read_file_header(ctx, buf, error) &&
+		check_decodable(ctx, error);
+}
+
+/*
+ * Looks at the layer count which starts layer info: a negative one means
+ * the first extra channel holds transparency of the composite image.
+ */
+static void
+check_transparency (PsdContext* ctx, const guchar* count)
+{
+	ctx->has_alpha = (gint16) read_uint16(count) < 0 &&
+		ctx->channels > color_mode_channels(ctx->color_mode);
+}
+
+/* keys of additional layer information with 8-byte lengths in PSB files */
+static const gchar psb_long_keys[][5] = {
+	"LMsk", "Lr16", "Lr32", "Layr", "Mt16", "Mt32", "Mtrn", "Alph",
+	"FMsk", "lnk2", "FEid", "FXid", "PxSD"
+};
+
+/*
+ * Looks at the first 8 bytes of a block of additional layer information
+ * in buf, its signature and key.
+ *
+ * Returns size of the length that follows, or 0 if buf does not start
+ * such a block.
+ */
+static guint
+tagged_length_size (PsdContext* ctx, const guchar* buf)
+{
+	guint i;
+
+	if (memcmp(buf, "8BIM", 4) != 0 && memcmp(buf, "8B64", 4) != 0) {
+		return 0;
+	}
+	if (ctx->psb) {
+		for (i = 0; i < G_N_ELEMENTS(psb_long_keys); i++) {
+			if (memcmp(buf + 4, psb_long_keys[i], 4) == 0) {
+				return 8;
+			}
+		}
+	}
+	return 4;
+}
+
+/* 16-bit and 32-bit documents keep layer info in one of these blocks;
+   32-bit images are not decoded, so Lr32 only matters to listing layers */
+static gboolean
+is_layer_info_key (const guchar* key)
+{
+	return memcmp(key, "Lr16", 4) == 0 || memcmp(key, "Lr32", 4) == 0;
+}
+
+/*
+ * Finds layer info (the layer count, layer records and their channel
+ * data) in the layers section of len bytes. 16-bit and 32-bit documents
+ * leave it empty and keep it, without its length, in an Lr16 or Lr32
+ * block of additional layer information after the global layer mask.
+ *
+ * Returns start of layer info, or NULL if there is none.
+ */
+static const guchar*
+find_layer_info (PsdContext* ctx, const guchar* data, guint64 len,
+                 guint64* info_len)
+{
+	const guchar* end = data + len;
+	guint n = layers_length_size(ctx);
+	guint64 size;
+
+	if (len < n || read_layers_length(ctx, data) > len - n) {
+		return NULL;
+	}
+	size = read_layers_length(ctx, data);
+	data += n;
+	if (size >= 2) {
+		*info_len = size;
+		return data;
+	}
+	data += size;
+
+	/* global layer mask info */
+	if (end - data < 4 || read_uint32(data) > (guint64) (end - data - 4)) {
+		return NULL;
+	}
+	data += 4 + read_uint32(data);
+
+	while (end - data >= 12) {
+		guint m = tagged_length_size(ctx, data);
+		const guchar* key = data + 4;
+
+		if (m == 0 || end - data < 8 + m) {
+			break;
+		}
+		size = m == 8 ? read_uint64(data + 8) : read_uint32(data + 8);
+		data += 8 + m;
+		if (size > (guint64) (end - data)) {
+			break;
+		}
+		if (is_layer_info_key(key) && size >= 2) {
+			*info_len = size;
+			return data;
+		}
+		/* rounded up to an even length */
+		data += MIN(size + (size & 1), (guint64) (end - data));
+	}
+	return NULL;
+}
+
+/*
+ * Converts line lengths, read into lines_lengths as they are stored in
+ * the file. 16-bit ones are widened in place, so start from the last one.
+ */
+static void
+convert_lines_lengths (PsdContext* ctx)
+{
+	guint m = rle_length_size(ctx);
+	gsize i = (gsize) ctx->height * ctx->channels;
+
+	while (i-- > 0) {
+		const guchar* p = (const guchar*) ctx->lines_lengths + i * m;
+		ctx->lines_lengths[i] = ctx->psb ? read_uint32(p) : read_uint16(p);
+	}
+}
+
+/*
+ * Parses compression type and line lengths which start image data,
+ * filling in ctx like the compression and line lengths states do.
+ *
+ * Returns start of channel data, or NULL if image data is not complete.
+ */
+static const guchar*
+parse_image_data (PsdContext* ctx, const guchar* data, gsize size,
+                  GError** error)
+{
+	const guchar* end = data + size;
+	gsize i;
+
+	if (end - data < 2) {
+		goto truncated;
+	}
+	ctx->compression = read_uint16(data);
+	data += 2;
+
+	if (ctx->compression == PSD_COMPRESSION_RLE) {
+		gsize n = (gsize) ctx->height * ctx->channels;
+		guint m = rle_length_size(ctx);
+		if (n * m > (gsize) (end - data)) {
+			goto truncated;
+		}
+		ctx->lines_lengths = arena_alloc(ctx, n * sizeof(guint32));
+		if (ctx->lines_lengths == NULL) {
+			g_set_error (error, GDK_PIXBUF_ERROR,
+				GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+				("Insufficient memory to load PSD image file"));
+			return NULL;
+		}
+		for (i = 0; i < n; i++) {
+			ctx->lines_lengths[i] = ctx->psb
+				? read_uint32(data + 4 * i) : read_uint16(data + 2 * i);
+		}
+		data += n * m;
+	} else if (ctx->compression != PSD_COMPRESSION_NONE) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+			("Unsupported compression type"));
+		return NULL;
+	}
+
+	ctx->data_size = channel_data_size(ctx);
+	if (ctx->data_size > (gsize) (end - data)) {
+		goto truncated;
+	}
+	return data;
+
+truncated:
+	g_set_error (error, GDK_PIXBUF_ERROR,
+		GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+		("PSD file is truncated"));
+	return NULL;
+}
+
+/*
+ * Parses the header of a whole file in memory and finds its sections.
+ * The layers section, without its length, is stored in *layers. Whether
+ * the image can be decoded is left to the caller (see check_decodable).
+ *
+ * Returns start of image data, or NULL if the file is not complete.
+ */
+static const guchar*
+find_sections (PsdContext* ctx, const guchar* data, gsize size,
+               const guchar** layers, guint64* layers_len, GError** error)
+{
+	const guchar* end = data + size;
+	gsize i;
+
+	if (size < PSD_HEADER_SIZE || memcmp(data, "8BPS", 4) != 0) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			("Not a PSD file"));
+		return NULL;
+	}
+	if (!read_file_header(ctx, data, error)) {
+		return NULL;
+	}
+	data += PSD_HEADER_SIZE;
+
+	/* color mode data, image resources and layers */
+	for (i = 0; i < 3; i++) {
+		guint n = i == 2 ? layers_length_size(ctx) : 4;
+		guint64 len;
+		if ((gsize) (end - data) < n) {
+			goto truncated;
+		}
+		len = i == 2 ? read_layers_length(ctx, data) : read_uint32(data);
+		data += n;
+		if (len > (guint64) (end - data)) {
+			goto truncated;
+		}
+		if (i == 2) {
+			*layers = data;
+			*layers_len = len;
+		}
+		data += len;
+	}
+	return data;
+
+truncated:
+	g_set_error (error, GDK_PIXBUF_ERROR,
+		GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+		("PSD file is truncated"));
+	return NULL;
+}
+
+/*
+ * Parses a whole file in memory up to the channel data.
+ *
+ * Returns start of channel data, or NULL if the file is not complete.
+ */
+static const guchar*
+parse_sections (PsdContext* ctx, const guchar* data, gsize size,
+                GError** error)
+{
+	const guchar* end = data + size;
+	const guchar* layers;
+	const guchar* info;
+	guint64 layers_len, info_len;
+
+	data = find_sections(ctx, data, size, &layers, &layers_len, error);
+	if (data == NULL || !check_decodable(ctx, error)) {
+		return NULL;
+	}
+	info = find_layer_info(ctx, layers, layers_len, &info_len);
+	if (info != NULL) {
+		check_transparency(ctx, info);
+	}
+	return parse_image_data(ctx, data, end - data, error);
+}
+
+/*
+ * Decodes thumbnail resource data, or returns NULL if it is not a JPEG
+ * thumbnail at least as large as the requested size.
+ */
+static GdkPixbuf*
+decode_thumbnail (PsdContext* ctx, const guchar* data, guint32 size,
+                  gboolean bgr)
+{
+	GdkPixbufLoader* loader;
+	GdkPixbuf* pixbuf = NULL;
+	gboolean ok;
+
+	/* format, width, height, widthbytes, total size, compressed size,
+	   bits per pixel, planes, then JFIF data */
+	if (size <= 28 || read_uint32(data) != 1 ||
+	    read_uint32(data + 4) < (guint32) ctx->req_width ||
+	    read_uint32(data + 8) < (guint32) ctx->req_height)
+	{
+		return NULL;
+	}
+
+	loader = gdk_pixbuf_loader_new_with_type("jpeg", NULL);
+	if (loader == NULL) {
+		return NULL;
+	}
+	ok = gdk_pixbuf_loader_write(loader, data + 28, size - 28, NULL);
+	ok = gdk_pixbuf_loader_close(loader, NULL) && ok;
+	if (ok && gdk_pixbuf_loader_get_pixbuf(loader) != NULL) {
+		pixbuf = g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+	}
+	g_object_unref(loader);
+
+	if (pixbuf != NULL && bgr) {
+		guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
+		guint n = gdk_pixbuf_get_n_channels(pixbuf);
+		gint i, j;
+		for (i = 0; i < gdk_pixbuf_get_height(pixbuf); i++) {
+			guchar* p = pixels + (gsize) i * gdk_pixbuf_get_rowstride(pixbuf);
+			for (j = 0; j < gdk_pixbuf_get_width(pixbuf); j++, p += n) {
+				guchar t = p[0];
+				p[0] = p[2];
+				p[2] = t;
+			}
+		}
+	}
+	return pixbuf;
+}
+
+/*
+ * Looks for the JPEG thumbnail in image resources block.
+ *
+ * Returns decoded thumbnail or NULL if there is none we can use.
+ */
+static GdkPixbuf*
+load_thumbnail (PsdContext* ctx, const guchar* data, guint32 size)
+{
+	const guchar* end = data + size;
+
+	while (end - data >= 12 && memcmp(data, "8BIM", 4) == 0) {
+		guint16 id = read_uint16(data + 4);
+		guint32 len;
+
+		/* skip name, a Pascal string padded to even size */
+		data += 6 + ((data[6] + 2) & ~1);
+		if (end - data < 4) {
+			break;
+		}
+		len = read_uint32(data);
+		data += 4;
+		if (len > (guint32) (end - data)) {
+			break;
+		}
+
+		if (id == PSD_RESOURCE_THUMBNAIL || id == PSD_RESOURCE_THUMBNAIL_PS4) {
+			GdkPixbuf* pixbuf = decode_thumbnail(ctx, data, len,
+				id == PSD_RESOURCE_THUMBNAIL_PS4);
+			if (pixbuf != NULL) {
+				return pixbuf;
+			}
+		}
+		data += MIN(len + (len & 1), (guint32) (end - data));
+	}
+	return NULL;
+}
+
+/* Sets up source columns of every column of a scaled image */
+static gboolean
+alloc_col_start (PsdContext* ctx)
+{
+	guint i;
+
+	ctx->col_start = arena_alloc(ctx, (ctx->out_width + 1) * sizeof(guint));
+	if (ctx->col_start == NULL) {
+		return FALSE;
+	}
+	for (i = 0; i <= ctx->out_width; i++) {
+		ctx->col_start[i] = (guint64) i * ctx->width / ctx->out_width;
+	}
+	return TRUE;
+}
+
+/*
+ * Creates the pixbuf and lets the caller know about it. This is done
+ * only when channel data arrives, as we may use the thumbnail instead,
+ * a truncated file may never get that far, and the first chunk tells
+ * whether transparency needs an RGBA pixbuf.
+ */
+static gboolean
+begin_channel_data (PsdContext* ctx, GError** error)
+{
+	ctx->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+		ctx->has_alpha, 8, ctx->out_width, ctx->out_height);
+	if (ctx->pixbuf == NULL) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			("Insufficient memory to load PSD image file"));
+		return FALSE;
+	}
+
+	if (ctx->scaled && !alloc_col_start(ctx)) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			("Insufficient memory to load PSD image file"));
+		return FALSE;
+	}
+
+	ctx->prepared_func(ctx->pixbuf, NULL, ctx->user_data);
+	return TRUE;
+}
+
+/*
+ * Allocates buffers for decoding channel data row by row. The buffered
+ * path does not need them, so this waits until the first row that does
+ * not arrive with the whole image.
+ *
+ * Channel rows are decoded one at a time and stored straight into the
+ * pixbuf; compressed data is decoded as it arrives, so it never needs
+ * to be buffered.
+ */
+static gboolean
+alloc_row_buffers (PsdContext* ctx)
+{
+	ctx->line = arena_alloc(ctx, (gsize) ctx->width * ctx->depth_bytes);
+	if (ctx->scaled) {
+		ctx->acc = arena_alloc(ctx, ctx->out_width * sizeof(guint32));
+		ctx->out_line = arena_alloc(ctx, ctx->out_width);
+		if (ctx->acc == NULL) {
+			return FALSE;
+		}
+		memset(ctx->acc, 0, ctx->out_width * sizeof(guint32));
+		return ctx->line != NULL && ctx->out_line != NULL;
+	}
+	return ctx->line != NULL;
+}
+
+static void
+reset_context_buffer(PsdContext* ctx)
+{
+	ctx->bytes_read = 0;
+	ctx->bytes_to_skip = 0;
+	ctx->bytes_to_skip_known = FALSE;
+	ctx->line_pos = 0;
+	ctx->rle.literal_left = 0;
+	ctx->rle.repeat_count = 0;
+}
+
+/* moves on to the next row of channel data */
+static void
+next_row (PsdContext* ctx)
+{
+	++ctx->curr_row;
+	if (ctx->curr_row >= ctx->height) {
+		++ctx->curr_ch;
+		ctx->curr_row = 0;
+		ctx->out_row = 0;
+		ctx->out_tap = 0;
+		/* alpha and spot channels are not displayed, ignore the rest */
+		if (ctx->curr_ch >= decoded_channels(ctx)) {
+			ctx->state = PSD_STATE_DONE;
+		}
+	}
+	reset_context_buffer(ctx);
+}
+
+static gpointer
+gdk_pixbuf__psd_image_begin_load (GdkPixbufModuleSizeFunc size_func,
+                                  GdkPixbufModulePreparedFunc prepared_func,
+                                  GdkPixbufModuleUpdatedFunc updated_func,
+                                  gpointer user_data,
+                                  GError **error)
+{
+	PsdContext* context = pool_take_context();
+	if (context == NULL) {
+		g_set_error (
+			error,
+			GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			("Not enough memory"));
+		return NULL;
+	}
+	context->size_func = size_func;
+	context->prepared_func = prepared_func;
+	context->updated_func = updated_func;
+	context->user_data = user_data;
+	
+	context->state = PSD_STATE_HEADER;
+
+	reset_context_buffer(context);
+	context->layers_left = 0;
+
+	context->pixbuf = NULL;
+	context->line = NULL;
+	context->curr_ch = 0;
+	context->curr_row = 0;
+	context->lines_lengths = NULL;
+	context->apply_k = NULL;
+	context->narrow = NULL;
+	context->has_alpha = FALSE;
+	context->arena = NULL;
+	context->charged = 0;
+	context->resources = NULL;
+	context->col_start = NULL;
+	context->acc = NULL;
+	context->out_line = NULL;
+	context->x0 = 0;
+	context->y0 = 0;
+
+	return (gpointer) context;
+}
+
+static gboolean
+gdk_pixbuf__psd_image_stop_load (gpointer context_ptr, GError **error)
+{
+	PsdContext *ctx = (PsdContext *) context_ptr;
+	gboolean retval = TRUE;
+
+	if (ctx->state != PSD_STATE_DONE) {
+		g_set_error (
+			error,
+			GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			("PSD file was corrupted or incomplete."));
+		retval = FALSE;
+	}
+	
+	arena_free(ctx);
+	release_budget(ctx);
+	g_free(ctx->resources);
+	if (ctx->pixbuf) {
+		g_object_unref(ctx->pixbuf);
+	}
+	pool_give_context(ctx);
+	
+	return retval;
+}
+
+
+static gboolean
+gdk_pixbuf__psd_image_load_increment (gpointer      context_ptr,
+                                      const guchar *data,
+                                      guint         size,
+                                      GError      **error)
+{
+	PsdContext* ctx = (PsdContext*) context_ptr;
+	
+	while (size > 0) {
+		switch (ctx->state) {
+			case PSD_STATE_HEADER:
+				if (feed_buffer(
+						ctx->buffer, &ctx->bytes_read,
+						&data, &size, PSD_HEADER_SIZE))
+				{
+					if (!read_header(ctx, ctx->buffer, error)) {
+						return FALSE;
+					}
+
+					ctx->preview = g_atomic_int_get(&progressive_preview) &&
+						color_mode_channels(ctx->color_mode) > 1;
+					
+					/* the caller is offered the size that fits in the
+					   budgets, so it does not scale the result back up */
+					ctx->out_width = ctx->width;
+					ctx->out_height = ctx->height;
+					if (ctx->width > 0 && ctx->height > 0 &&
+					    !fit_budget(ctx, &ctx->out_width, &ctx->out_height))
+					{
+						g_set_error (error, GDK_PIXBUF_ERROR,
+							GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+							("Image does not fit in the memory budget"));
+						return FALSE;
+					}
+
+					ctx->req_width = ctx->out_width;
+					ctx->req_height = ctx->out_height;
+					if (ctx->size_func) {
+						ctx->size_func(&ctx->req_width, &ctx->req_height,
+							ctx->user_data);
+						if (ctx->req_width == 0 || ctx->req_height == 0) {
+							return FALSE;
+						}
+					}
+
+					/* decode straight to a smaller requested size; larger
+					   sizes are left to the caller, unless the budgets
+					   already made the image smaller */
+					if (ctx->req_width > 0 && ctx->req_height > 0 &&
+					    (guint) ctx->req_width <= ctx->out_width &&
+					    (guint) ctx->req_height <= ctx->out_height)
+					{
+						if ((guint) ctx->req_width < ctx->out_width ||
+						    (guint) ctx->req_height < ctx->out_height)
+						{
+							ctx->out_width = ctx->req_width;
+							ctx->out_height = ctx->req_height;
+							release_budget(ctx);
+							if (!charge_budget(ctx, load_cost(ctx,
+									ctx->out_width, ctx->out_height)))
+							{
+								g_set_error (error, GDK_PIXBUF_ERROR,
+									GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+									("Image does not fit in the memory budget"));
+								return FALSE;
+							}
+						}
+					} else if (ctx->out_width < ctx->width ||
+					           ctx->out_height < ctx->height)
+					{
+						g_set_error (error, GDK_PIXBUF_ERROR,
+							GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+							("Image does not fit in the memory budget"));
+						return FALSE;
+					}
+					ctx->scaled = ctx->out_width < ctx->width ||
+						ctx->out_height < ctx->height;
+					ctx->out_row = 0;
+					ctx->out_tap = 0;
+
+					if (ctx->color_mode == PSD_MODE_CMYK) {
+						ctx->apply_k = get_cmyk_kernel();
+					}
+
+
+					/* nothing is allocated until image data starts, so
+					   loads that stop early stay cheap */
+					ctx->state = PSD_STATE_COLOR_MODE_BLOCK;
+					reset_context_buffer(ctx);
+				}
+				break;
+			case PSD_STATE_COLOR_MODE_BLOCK:
 				if (skip_block(ctx, &data, &size)) {
+					ctx->state = PSD_STATE_RESOURCES_BLOCK;
+					reset_context_buffer(ctx);
+				}
+				break;
+			case PSD_STATE_RESOURCES_BLOCK:
+				if (!ctx->bytes_to_skip_known &&
+				    ctx->req_width <= PSD_THUMBNAIL_MAX_SIZE &&
+				    ctx->req_height <= PSD_THUMBNAIL_MAX_SIZE &&
+				    (ctx->req_width < ctx->width ||
+				     ctx->req_height < ctx->height))
+				{
+					/* small size requested, keep the resources to look
+					   for the thumbnail */
+					if (ctx->resources == NULL) {
+						if (!feed_buffer(ctx->buffer, &ctx->bytes_read,
+								&data, &size, 4))
+						{
+							break;
+						}
+						ctx->resources_size = read_uint32(ctx->buffer);
+						if (ctx->resources_size <= PSD_MAX_RESOURCES_SIZE) {
+							ctx->resources = g_try_malloc(
+								MAX(ctx->resources_size, 1));
+						}
+						if (ctx->resources == NULL) {
+							/* too large, just skip it */
+							ctx->bytes_to_skip = ctx->resources_size;
+							ctx->bytes_to_skip_known = TRUE;
+							break;
+						}
+						ctx->bytes_read = 0;
+					}
+					if (feed_buffer(ctx->resources, &ctx->bytes_read,
+							&data, &size, ctx->resources_size))
+					{
+						ctx->pixbuf = load_thumbnail(ctx,
+							ctx->resources, ctx->resources_size);
+						g_free(ctx->resources);
+						ctx->resources = NULL;
+						reset_context_buffer(ctx);
+
+						if (ctx->pixbuf != NULL) {
+							/* no need to read the rest, nor to keep
+							   memory for decoding it */
+							release_budget(ctx);
+							ctx->prepared_func(ctx->pixbuf, NULL,
+								ctx->user_data);
+							if (ctx->updated_func) {
+								ctx->updated_func(ctx->pixbuf, 0, 0,
+									gdk_pixbuf_get_width(ctx->pixbuf),
+									gdk_pixbuf_get_height(ctx->pixbuf),
+									ctx->user_data);
+							}
+							ctx->state = PSD_STATE_DONE;
+						} else {
+							ctx->state = PSD_STATE_LAYERS_BLOCK;
+						}
+					}
+				} else if (skip_block(ctx, &data, &size)) {
 					ctx->state = PSD_STATE_LAYERS_BLOCK;
 					reset_context_buffer(ctx);
 				}
 				break;
 			case PSD_STATE_LAYERS_BLOCK:
+				if (feed_buffer(ctx->buffer, &ctx->bytes_read, &data, &size,
+						layers_length_size(ctx)))
+				{
+					ctx->layers_left = read_layers_length(ctx, ctx->buffer);
+					ctx->state = PSD_STATE_LAYER_INFO;
+					reset_context_buffer(ctx);
+				}
+				break;
+			case PSD_STATE_LAYER_INFO:
+				/* only the layer count is needed, for transparency */
+				{
+					guint n = layers_length_size(ctx);
+					guint64 len;
+					if (ctx->layers_left < n + 2) {
+						skip_layers_rest(ctx, 0);
+						break;
+					}
+					if (ctx->bytes_read < n + 2 && !feed_buffer(ctx->buffer,
+							&ctx->bytes_read, &data, &size, n + 2))
+					{
+						break;
+					}
+					len = read_layers_length(ctx, ctx->buffer);
+					if (len >= 2) {
+						check_transparency(ctx, ctx->buffer + n);
+						skip_layers_rest(ctx, n + 2);
+						break;
+					}
+					if (len != 0 || ctx->layers_left < n + 4) {
+						skip_layers_rest(ctx, n + 2);
+						break;
+					}
+
+					/* empty, look for it after the global layer mask */
+					if (ctx->bytes_read < n + 4 && !feed_buffer(ctx->buffer,
+							&ctx->bytes_read, &data, &size, n + 4))
+					{
+						break;
+					}
+					len = read_uint32(ctx->buffer + n);
+					if (len > ctx->layers_left - n - 4) {
+						skip_layers_rest(ctx, n + 4);
+						break;
+					}
+					ctx->layers_left -= n + 4 + len;
+					reset_context_buffer(ctx);
+					ctx->bytes_to_skip = len;
+					ctx->bytes_to_skip_known = TRUE;
+					ctx->state = PSD_STATE_LAYERS_TAGGED;
+				}
+				break;
+			case PSD_STATE_LAYERS_TAGGED:
+				/* blocks of additional layer information */
+				{
+					guint m;
+					guint64 len;
+					if (ctx->bytes_to_skip_known) {
+						if (!skip_block(ctx, &data, &size)) {
+							break;
+						}
+						reset_context_buffer(ctx);
+					}
+					if (ctx->layers_left < 12) {
+						skip_layers_rest(ctx, 0);
+						break;
+					}
+					if (ctx->bytes_read < 8 && !feed_buffer(ctx->buffer,
+							&ctx->bytes_read, &data, &size, 8))
+					{
+						break;
+					}
+					m = tagged_length_size(ctx, ctx->buffer);
+					if (m == 0 || ctx->layers_left < 8 + m) {
+						skip_layers_rest(ctx, 8);
+						break;
+					}
+					if (ctx->bytes_read < 8 + m && !feed_buffer(ctx->buffer,
+							&ctx->bytes_read, &data, &size, 8 + m))
+					{
+						break;
+					}
+					len = m == 8
+						? read_uint64(ctx->buffer + 8)
+						: read_uint32(ctx->buffer + 8);
+					if (len > ctx->layers_left - 8 - m) {
+						skip_layers_rest(ctx, 8 + m);
+						break;
+					}
+					if (is_layer_info_key(ctx->buffer + 4) && len >= 2) {
+						if (feed_buffer(ctx->buffer, &ctx->bytes_read,
+								&data, &size, 8 + m + 2))
+						{
+							check_transparency(ctx, ctx->buffer + 8 + m);
+							skip_layers_rest(ctx, 8 + m + 2);
+						}
+						break;
+					}
+					ctx->layers_left -= 8 + m;
+					len = MIN(len + (len & 1), ctx->layers_left);
+					ctx->layers_left -= len;
+					reset_context_buffer(ctx);
+					ctx->bytes_to_skip = len;
+					ctx->bytes_to_skip_known = TRUE;
+				}
+				break;
+			case PSD_STATE_LAYERS_SKIP:
 				if (skip_block(ctx, &data, &size)) {
 					ctx->state = PSD_STATE_COMPRESSION;
 					reset_context_buffer(ctx);
@@ -431,9 +3117,18 @@ gdk_pixbuf__psd_image_load_increment (gpointer      context_ptr,
 					ctx->compression = read_uint16(ctx->buffer);
 
 					if (ctx->compression == PSD_COMPRESSION_RLE) {
+						ctx->lines_lengths = arena_alloc(ctx,
+							sizeof(guint32) * ctx->channels * ctx->height);
+						if (ctx->lines_lengths == NULL) {
+							g_set_error (error, GDK_PIXBUF_ERROR,
+								GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+								("Insufficient memory to load PSD image file"));
+							return FALSE;
+						}
 						ctx->state = PSD_STATE_LINES_LENGTHS;
 						reset_context_buffer(ctx);
 					} else if (ctx->compression == PSD_COMPRESSION_NONE) {
+						ctx->data_size = channel_data_size(ctx);
 						ctx->state = PSD_STATE_CHANNEL_DATA;
 						reset_context_buffer(ctx);
 					} else {
@@ -447,51 +3142,156 @@ gdk_pixbuf__psd_image_load_increment (gpointer      context_ptr,
 			case PSD_STATE_LINES_LENGTHS:
 				if (feed_buffer(
 						(guchar*) ctx->lines_lengths, &ctx->bytes_read, &data,
-						 &size,	2 * ctx->height * ctx->channels))
+						 &size,	rle_length_size(ctx) * (gsize) ctx->height * ctx->channels))
 				{
-					/* convert from different endianness */
-					for (i = 0; i < ctx->height * ctx->channels; i++) {
-						ctx->lines_lengths[i] = read_uint16(
-							(guchar*) &ctx->lines_lengths[i]);
-					}
+					convert_lines_lengths(ctx);
+					ctx->data_size = channel_data_size(ctx);
 					ctx->state = PSD_STATE_CHANNEL_DATA;
 					reset_context_buffer(ctx);
 				}
 				break;
 			case PSD_STATE_CHANNEL_DATA:
+				if (ctx->pixbuf == NULL) {
+					/* with all data at hand we can see if transparency
+					   is worth keeping */
+					if (ctx->has_alpha && size >= ctx->data_size &&
+					    alpha_is_opaque(ctx, data))
+					{
+						ctx->has_alpha = FALSE;
+					}
+					if (!begin_channel_data(ctx, error)) {
+						return FALSE;
+					}
+					if (ctx->has_alpha && size < ctx->data_size) {
+						/* transparency arrives last, show rows opaque
+						   until then */
+						gdk_pixbuf_fill(ctx->pixbuf, 0x000000ff);
+					}
+				}
+				if (ctx->curr_ch == 0 && ctx->curr_row == 0 &&
+				    ctx->bytes_read == 0 && size >= ctx->data_size)
+				{
+					/* whole image is in this chunk */
+					if (!decode_buffered(ctx, data, error)) {
+						return FALSE;
+					}
+					if (ctx->updated_func) {
+						ctx->updated_func(ctx->pixbuf, 0, 0, ctx->out_width,
+							ctx->out_height, ctx->user_data);
+					}
+					data += ctx->data_size;
+					size -= ctx->data_size;
+					ctx->state = PSD_STATE_DONE;
+				} else if (ctx->scaled && (ctx->out_row >= ctx->out_height ||
+				           ctx->curr_row != scale_tap_row(ctx,
+				               ctx->out_row, ctx->out_tap)))
 				{
-					guint line_length = ctx->width * ctx->depth_bytes;
+					/* row is not sampled by the scaled image */
+					gsize row_length = ctx->compression == PSD_COMPRESSION_RLE
+						? ctx->lines_lengths[
+							ctx->curr_ch * ctx->height + ctx->curr_row]
+						: (gsize) ctx->width * ctx->depth_bytes;
+					gsize how_many = MIN(size, row_length - ctx->bytes_read);
+
+					data += how_many;
+					size -= how_many;
+					ctx->bytes_read += how_many;
+					if (ctx->bytes_read == row_length) {
+						next_row(ctx);
+					}
+				} else {
+					gsize row_bytes = (gsize) ctx->width * ctx->depth_bytes;
+					const guchar* line;
+					guint row = ctx->curr_row;
+
+					if (ctx->line == NULL && !alloc_row_buffers(ctx)) {
+						g_set_error (error, GDK_PIXBUF_ERROR,
+							GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+							("Insufficient memory to load PSD image file"));
+						return FALSE;
+					}
+					line = ctx->line;
+
 					if (ctx->compression == PSD_COMPRESSION_RLE) {
-						line_length = ctx->lines_lengths[
+						guint line_length = ctx->lines_lengths[
 							ctx->curr_ch * ctx->height + ctx->curr_row];
-					}
-					
-					if (feed_buffer(ctx->buffer, &ctx->bytes_read, &data, &size,
-							line_length))
+						gboolean ok;
+
+						if (ctx->bytes_read == 0 && size >= line_length) {
+							/* whole row is in this chunk */
+							ok = decompress_line(data, line_length,
+								ctx->line, row_bytes);
+							data += line_length;
+							size -= line_length;
+						} else {
+							guint how_many =
+								MIN(size, line_length - ctx->bytes_read);
+							ok = decompress_partial(&ctx->rle, data, how_many,
+								ctx->line, &ctx->line_pos, row_bytes);
+							data += how_many;
+							size -= how_many;
+							ctx->bytes_read += how_many;
+							if (ok && ctx->bytes_read < line_length) {
+								break;
+							}
+							/* row must not end in the middle of a run */
+							if (ctx->rle.literal_left > 0 ||
+							    ctx->rle.repeat_count > 0)
+							{
+								ok = FALSE;
+							} else {
+								memset(ctx->line + ctx->line_pos, 0,
+									row_bytes - ctx->line_pos);
+							}
+						}
+						if (!ok) {
+							g_set_error (error, GDK_PIXBUF_ERROR,
+								GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+								("Corrupted RLE data"));
+							return FALSE;
+						}
+					} else if (!feed_line(ctx, &data, &size, row_bytes,
+							ctx->line, &line))
 					{
-						if (ctx->compression == PSD_COMPRESSION_RLE) {
-							decompress_line(ctx->buffer, line_length,
-								ctx->ch_bufs[ctx->curr_ch] + ctx->pos
-							);
+						break;
+					}
+					if (ctx->depth_bytes == 2) {
+						narrow_row(ctx, ctx->line, line, ctx->curr_row);
+						line = ctx->line;
+					}
+
+					if (ctx->scaled) {
+						/* sum the taps, store once all of them are in */
+						scale_add_row(ctx, ctx->acc, line);
+						row = ctx->out_row;
+						if (++ctx->out_tap == scale_row_taps(ctx, row)) {
+							scale_finish_row(ctx, ctx->acc, ctx->out_line,
+								ctx->out_tap);
+							line = ctx->out_line;
+							ctx->out_row++;
+							ctx->out_tap = 0;
 						} else {
-							memcpy(ctx->ch_bufs[ctx->curr_ch] + ctx->pos,
-								ctx->buffer, line_length);
+							line = NULL;
 						}
-						
-						ctx->pos += ctx->width * ctx->depth_bytes;
-						++ctx->curr_row;
-					
-						if (ctx->curr_row >= ctx->height) {
-							++ctx->curr_ch;
-							ctx->curr_row = 0;
-							ctx->pos = 0;
-							if (ctx->curr_ch >= ctx->channels) {
-								ctx->state = PSD_STATE_DONE;
-							}
+					}
+
+					if (line != NULL) {
+						store_channel_row(ctx, ctx->curr_ch, row, line);
+
+						/* rows are complete once the last color channel is
+						   stored, and change again when transparency arrives
+						   after it; the first one gives a preview */
+						if (ctx->updated_func && (ctx->curr_ch ==
+							color_mode_channels(ctx->color_mode) - 1 ||
+							ctx->curr_ch == decoded_channels(ctx) - 1 ||
+							(ctx->curr_ch == 0 && ctx->preview)))
+						{
+							ctx->updated_func(ctx->pixbuf, 0, row,
+								ctx->out_width, 1, ctx->user_data);
 						}
-						
-						reset_context_buffer(ctx);
 					}
+					
+					next_row(ctx);
 				}
 				break;
 			case PSD_STATE_DONE:
@@ -500,60 +3300,1152 @@ gdk_pixbuf__psd_image_load_increment (gpointer      context_ptr,
 				break;
 		}
 	}
-	
-	if (ctx->state == PSD_STATE_DONE && !ctx->finalized) {
-		/* convert or copy channel buffers to our GdkPixbuf */
-		guchar* pixels = gdk_pixbuf_get_pixels(ctx->pixbuf);
-		guint b = ctx->depth_bytes;
-
-		if (ctx->color_mode == PSD_MODE_RGB) {
-			for (i = 0; i < ctx->height; i++) {
-				for (j = 0; j < ctx->width; j++) {
-					pixels[3*j+0] = ctx->ch_bufs[0][ctx->width*i*b + j*b];
-					pixels[3*j+1] = ctx->ch_bufs[1][ctx->width*i*b + j*b];
-					pixels[3*j+2] = ctx->ch_bufs[2][ctx->width*i*b + j*b];
-				}
-				pixels += gdk_pixbuf_get_rowstride(ctx->pixbuf);
+	
+	return TRUE;
+}
+
+
+/*
+ * Sets up decoding of the whole image, or only the given region of it,
+ * once the header and line lengths are known: the output size, which is
+ * scaled down for whole images that do not fit in the memory budgets.
+ */
+static gboolean
+setup_output (PsdContext* ctx,
+              gboolean    whole,
+              gint        x,
+              gint        y,
+              gint        width,
+              gint        height,
+              GError**    error)
+{
+	if (whole) {
+		x = y = 0;
+		width = ctx->width;
+		height = ctx->height;
+	}
+	if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+	    (guint) x > ctx->width || (guint) width > ctx->width - x ||
+	    (guint) y > ctx->height || (guint) height > ctx->height - y)
+	{
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			whole ? GDK_PIXBUF_ERROR_CORRUPT_IMAGE : GDK_PIXBUF_ERROR_FAILED,
+			whole ? ("Image has zero size") : ("Region is outside of the image"));
+		return FALSE;
+	}
+	ctx->x0 = x;
+	ctx->y0 = y;
+	ctx->out_width = width;
+	ctx->out_height = height;
+
+	/* whole images are scaled down to fit the budgets, regions are
+	   decoded as asked or not at all */
+	if (whole ? !fit_budget(ctx, &ctx->out_width, &ctx->out_height)
+	          : !charge_budget(ctx, load_cost(ctx, width, height)))
+	{
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			("Image does not fit in the memory budget"));
+		return FALSE;
+	}
+	ctx->scaled = whole && (ctx->out_width < ctx->width ||
+		ctx->out_height < ctx->height);
+	if (ctx->scaled && !alloc_col_start(ctx)) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			("Insufficient memory to load PSD image file"));
+		return FALSE;
+	}
+	if (ctx->color_mode == PSD_MODE_CMYK) {
+		ctx->apply_k = get_cmyk_kernel();
+	}
+	return TRUE;
+}
+
+/*
+ * Decodes the whole image, or only the given region of it, once ctx is
+ * filled in by parse_image_data.
+ */
+static GdkPixbuf*
+decode_region (PsdContext*   ctx,
+               const guchar* channel_data,
+               gboolean      whole,
+               gint          x,
+               gint          y,
+               gint          width,
+               gint          height,
+               GError**      error)
+{
+	if (!setup_output(ctx, whole, x, y, width, height, error)) {
+		return NULL;
+	}
+
+	if (ctx->has_alpha && alpha_is_opaque(ctx, channel_data)) {
+		ctx->has_alpha = FALSE;
+	}
+
+	ctx->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, ctx->has_alpha, 8,
+		ctx->out_width, ctx->out_height);
+	if (ctx->pixbuf == NULL) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+			("Insufficient memory to load PSD image file"));
+		return NULL;
+	}
+	if (!decode_buffered(ctx, channel_data, error)) {
+		g_object_unref(ctx->pixbuf);
+		return NULL;
+	}
+	return ctx->pixbuf;
+}
+
+/*
+ * Decodes a whole file in memory, or only the given region of it.
+ */
+static GdkPixbuf*
+load_data (const guchar* data,
+           gsize         size,
+           gboolean      whole,
+           gint          x,
+           gint          y,
+           gint          width,
+           gint          height,
+           GError**      error)
+{
+	PsdContext ctx;
+	const guchar* channel_data;
+	GdkPixbuf* pixbuf = NULL;
+
+	memset(&ctx, 0, sizeof(ctx));
+	channel_data = parse_sections(&ctx, data, size, error);
+	if (channel_data != NULL) {
+		pixbuf = decode_region(&ctx, channel_data,
+			whole, x, y, width, height, error);
+	}
+	arena_free(&ctx);
+	release_budget(&ctx);
+	return pixbuf;
+}
+
+/*
+ * Reads the name of a layer from its extra data: the Unicode name from
+ * additional layer information if there is one, else the Pascal name.
+ */
+static gchar*
+read_layer_name (PsdContext* ctx, const guchar* data, const guchar* end)
+{
+	const guchar* pascal;
+	gchar* name;
+	gint i;
+
+	/* mask data and blending ranges */
+	for (i = 0; i < 2; i++) {
+		if (end - data < 4 || read_uint32(data) > (guint64) (end - data - 4)) {
+			return g_strdup("");
+		}
+		data += 4 + read_uint32(data);
+	}
+	if (end - data < 1 || data[0] >= end - data) {
+		return g_strdup("");
+	}
+	pascal = data;
+
+	/* the Pascal name is padded to a multiple of 4 bytes */
+	data += MIN((pascal[0] + 4) & ~3, end - data);
+	while (end - data >= 12) {
+		const guchar* key = data + 4;
+		guint m = tagged_length_size(ctx, data);
+		guint64 len;
+
+		if (m == 0 || end - data < 8 + m) {
+			break;
+		}
+		len = m == 8 ? read_uint64(data + 8) : read_uint32(data + 8);
+		data += 8 + m;
+		if (len > (guint64) (end - data)) {
+			break;
+		}
+		if (memcmp(key, "luni", 4) == 0 && len >= 4 &&
+		    read_uint32(data) <= (len - 4) / 2)
+		{
+			name = g_convert((const gchar*) data + 4, read_uint32(data) * 2,
+				"UTF-8", "UTF-16BE", NULL, NULL, NULL);
+			if (name != NULL) {
+				return name;
+			}
+		}
+		data += len;
+	}
+
+	name = g_strndup((const gchar*) pascal + 1, pascal[0]);
+	if (!g_utf8_validate(name, -1, NULL)) {
+		gchar* latin1 = name;
+		name = g_convert(latin1, -1, "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+		g_free(latin1);
+	}
+	return name != NULL ? name : g_strdup("");
+}
+
+static void
+free_layers (GdkPixbufPsdLayer* layers, guint n_layers)
+{
+	guint i;
+
+	for (i = 0; i < n_layers; i++) {
+		g_free(layers[i].name);
+		g_free(layers[i].channels);
+	}
+	g_free(layers);
+}
+
+/*
+ * Parses the layer records of the layers section of a file at base,
+ * found in layer info or, for 16-bit and 32-bit documents, in an Lr16
+ * or Lr32 block (see find_layer_info). Channel data following the
+ * records is not read, its offsets come from the channel lengths in the
+ * records.
+ */
+static gboolean
+parse_layer_records (PsdContext*         ctx,
+                     const guchar*       base,
+                     const guchar*       data,
+                     guint64             len,
+                     GdkPixbufPsdLayer** layers,
+                     guint*              n_layers,
+                     GError**            error)
+{
+	guint n = layers_length_size(ctx);
+	GdkPixbufPsdLayer* list;
+	const guchar* end;
+	guint64 offset, info_len;
+	guint count, i, c;
+
+	*layers = NULL;
+	*n_layers = 0;
+	if (len >= n && read_layers_length(ctx, data) > len - n) {
+		goto corrupted;
+	}
+	data = find_layer_info(ctx, data, len, &info_len);
+	if (data == NULL) {
+		return TRUE;
+	}
+	end = data + info_len;
+
+	/* negative when the first extra channel is transparency */
+	count = ABS((gint16) read_uint16(data));
+	data += 2;
+	list = g_new0(GdkPixbufPsdLayer, count);
+
+	for (i = 0; i < count; i++) {
+		GdkPixbufPsdLayer* layer = &list[i];
+		guint32 extra;
+
+		if (end - data < 18) {
+			goto corrupted_free;
+		}
+		layer->top = (gint32) read_uint32(data);
+		layer->left = (gint32) read_uint32(data + 4);
+		layer->bottom = (gint32) read_uint32(data + 8);
+		layer->right = (gint32) read_uint32(data + 12);
+		layer->n_channels = read_uint16(data + 16);
+		data += 18;
+
+		if (layer->n_channels > (end - data) / (2 + n)) {
+			goto corrupted_free;
+		}
+		layer->channels = g_new(GdkPixbufPsdLayerChannel, layer->n_channels);
+		for (c = 0; c < layer->n_channels; c++) {
+			layer->channels[c].id = (gint16) read_uint16(data);
+			layer->channels[c].length = read_layers_length(ctx, data + 2);
+			data += 2 + n;
+		}
+
+		if (end - data < 16 || memcmp(data, "8BIM", 4) != 0) {
+			goto corrupted_free;
+		}
+		memcpy(layer->blend_mode, data + 4, 4);
+		layer->blend_mode[4] = '\0';
+		layer->opacity = data[8];
+		layer->visible = (data[10] & 0x02) == 0;
+		extra = read_uint32(data + 12);
+		data += 16;
+		if (extra > (guint64) (end - data)) {
+			goto corrupted_free;
+		}
+		layer->name = read_layer_name(ctx, data, data + extra);
+		data += extra;
+	}
+
+	/* channel data of every layer follows, in the same order */
+	offset = data - base;
+	for (i = 0; i < count; i++) {
+		for (c = 0; c < list[i].n_channels; c++) {
+			if (list[i].channels[c].length > (guint64) (end - base) - offset) {
+				goto corrupted_free;
+			}
+			list[i].channels[c].offset = offset;
+			offset += list[i].channels[c].length;
+		}
+	}
+
+	*layers = list;
+	*n_layers = count;
+	return TRUE;
+
+corrupted_free:
+	free_layers(list, count);
+corrupted:
+	g_set_error (error, GDK_PIXBUF_ERROR,
+		GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+		("Layer records are corrupted"));
+	return FALSE;
+}
+
+/* Moves f len bytes forward, reading through streams that cannot seek */
+static gboolean
+skip_bytes (FILE* f, guint64 len)
+{
+	/* sections of PSB files may be longer than a long */
+	while (len > 0) {
+		long step = MIN(len, G_MAXLONG);
+		if (fseek(f, step, SEEK_CUR) != 0) {
+			break;
+		}
+		len -= step;
+	}
+	while (len > 0) {
+		guchar skip[4096];
+		gsize got = fread(skip, 1, MIN(len, sizeof(skip)), f);
+		if (got == 0) {
+			return FALSE;
+		}
+		len -= got;
+	}
+	return TRUE;
+}
+
+/*
+ * Moves f past the layers section of len bytes, reading only what leads
+ * to the layer count, like find_layer_info does in memory.
+ *
+ * Returns false if the file ends first.
+ */
+static gboolean
+skip_layers (PsdContext* ctx, FILE* f, guint64 len)
+{
+	guint n = layers_length_size(ctx);
+	guchar buf[16];
+	guint64 size;
+
+	if (len < n + 2) {
+		return skip_bytes(f, len);
+	}
+	if (fread(buf, 1, n, f) != n) {
+		return FALSE;
+	}
+	len -= n;
+	size = read_layers_length(ctx, buf);
+	if (size >= 2 && size <= len) {
+		if (fread(buf, 1, 2, f) != 2) {
+			return FALSE;
+		}
+		check_transparency(ctx, buf);
+		return skip_bytes(f, len - 2);
+	}
+	if (size > len) {
+		return skip_bytes(f, len);
+	}
+	if (!skip_bytes(f, size)) {
+		return FALSE;
+	}
+	len -= size;
+
+	/* global layer mask info */
+	if (len < 4) {
+		return skip_bytes(f, len);
+	}
+	if (fread(buf, 1, 4, f) != 4) {
+		return FALSE;
+	}
+	len -= 4;
+	size = read_uint32(buf);
+	if (size > len) {
+		return skip_bytes(f, len);
+	}
+	if (!skip_bytes(f, size)) {
+		return FALSE;
+	}
+	len -= size;
+
+	while (len >= 12) {
+		guint m;
+
+		if (fread(buf, 1, 8, f) != 8) {
+			return FALSE;
+		}
+		len -= 8;
+		m = tagged_length_size(ctx, buf);
+		if (m == 0 || len < m) {
+			break;
+		}
+		if (fread(buf + 8, 1, m, f) != m) {
+			return FALSE;
+		}
+		len -= m;
+		size = m == 8 ? read_uint64(buf + 8) : read_uint32(buf + 8);
+		if (size > len) {
+			break;
+		}
+		if (is_layer_info_key(buf + 4) && size >= 2) {
+			if (fread(buf, 1, 2, f) != 2) {
+				return FALSE;
 			}
-		} else if (ctx->color_mode == PSD_MODE_GRAYSCALE ||
-		           ctx->color_mode == PSD_MODE_DUOTONE)
+			len -= 2;
+			check_transparency(ctx, buf);
+			break;
+		}
+		size = MIN(size + (size & 1), len);
+		if (!skip_bytes(f, size)) {
+			return FALSE;
+		}
+		len -= size;
+	}
+	return skip_bytes(f, len);
+}
+
+/*
+ * Reads the header and moves f past the color mode, resources and layers
+ * sections to the start of image data. Sections are sought over using
+ * their lengths, so only a few bytes of them are read from disk.
+ */
+static gboolean
+seek_image_data (PsdContext* ctx, FILE* f, GError** error)
+{
+	guchar buf[PSD_HEADER_SIZE];
+	gint i;
+
+	if (fread(buf, 1, PSD_HEADER_SIZE, f) != PSD_HEADER_SIZE ||
+	    memcmp(buf, "8BPS", 4) != 0)
+	{
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			("Not a PSD file"));
+		return FALSE;
+	}
+	if (!read_header(ctx, buf, error)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < 3; i++) {
+		guint n = i == 2 ? layers_length_size(ctx) : 4;
+		guint64 len;
+
+		if (fread(buf, 1, n, f) != n) {
+			goto truncated;
+		}
+		len = i == 2 ? read_layers_length(ctx, buf) : read_uint32(buf);
+		if (i == 2 ? !skip_layers(ctx, f, len) : !skip_bytes(f, len)) {
+			goto truncated;
+		}
+	}
+	return TRUE;
+
+truncated:
+	g_set_error (error, GDK_PIXBUF_ERROR,
+		GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+		("PSD file is truncated"));
+	return FALSE;
+}
+
+
+/*
+ * Reads compression type and line lengths at the start of image data
+ * from f, filling in ctx like parse_image_data.
+ */
+static gboolean
+read_image_data_header (PsdContext* ctx, FILE* f, GError** error)
+{
+	gsize n = (gsize) ctx->height * ctx->channels;
+	guchar buf[2];
+
+	if (fread(buf, 1, 2, f) != 2) {
+		goto truncated;
+	}
+	ctx->compression = read_uint16(buf);
+
+	if (ctx->compression == PSD_COMPRESSION_RLE) {
+		ctx->lines_lengths = arena_alloc(ctx, n * sizeof(guint32));
+		if (ctx->lines_lengths == NULL) {
+			g_set_error (error, GDK_PIXBUF_ERROR,
+				GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+				("Insufficient memory to load PSD image file"));
+			return FALSE;
+		}
+		if (fread(ctx->lines_lengths, rle_length_size(ctx), n, f) != n) {
+			goto truncated;
+		}
+		convert_lines_lengths(ctx);
+	} else if (ctx->compression != PSD_COMPRESSION_NONE) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+			("Unsupported compression type"));
+		return FALSE;
+	}
+	ctx->data_size = channel_data_size(ctx);
+	return TRUE;
+
+truncated:
+	g_set_error (error, GDK_PIXBUF_ERROR,
+		GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+		("PSD file is truncated"));
+	return FALSE;
+}
+
+/* Returns size of data of rows y to y + rows - 1 of channel c */
+static guint64
+channel_rows_size (PsdContext* ctx, guint c, guint y, guint rows)
+{
+	guint64 size = 0;
+	guint i;
+
+	if (ctx->compression != PSD_COMPRESSION_RLE) {
+		return (guint64) rows * ctx->width * ctx->depth_bytes;
+	}
+	for (i = y; i < y + rows; i++) {
+		size += ctx->lines_lengths[c * ctx->height + i];
+	}
+	return size;
+}
+
+/*
+ * Reads rows y to y + rows - 1 of every channel from channel data at
+ * start in f into buffer, and points src at them. pos holds the offset
+ * of row *row in each channel, rows between are sought over.
+ */
+static gboolean
+read_channel_rows (PsdContext*    ctx,
+                   FILE*          f,
+                   off_t          start,
+                   guint64*       pos,
+                   guint*         row,
+                   guint          y,
+                   guint          rows,
+                   guchar*        buffer,
+                   const guchar** src,
+                   GError**       error)
+{
+	guint n = decoded_channels(ctx);
+	guint c;
+
+	for (c = 0; c < n; c++) {
+		gsize size;
+
+		pos[c] += channel_rows_size(ctx, c, *row, y - *row);
+		size = channel_rows_size(ctx, c, y, rows);
+		if (fseeko(f, start + (off_t) pos[c], SEEK_SET) != 0 ||
+		    fread(buffer, 1, size, f) != size)
 		{
-			for (i = 0; i < ctx->height; i++) {
-				for (j = 0; j < ctx->width; j++) {
-					pixels[3*j+0] = pixels[3*j+1] = pixels[3*j+2] =
-						ctx->ch_bufs[0][ctx->width*i*b + j*b];
-				}
-				pixels += gdk_pixbuf_get_rowstride(ctx->pixbuf);
-			}
-		} else if (ctx->color_mode == PSD_MODE_CMYK) {
-			/* unfortunately, this doesn't work 100% correctly...
-			   CMYK-RGB conversion distorts colors significantly  */
-		
-			guchar* pixels = gdk_pixbuf_get_pixels(ctx->pixbuf);
-			for (i = 0; i < ctx->height; i++) {
-				for (j = 0; j < ctx->width; j++) {
-					double c = 1.0 -
-						(double) ctx->ch_bufs[0][ctx->width*i + j] / 255.0;
-					double m = 1.0 -
-						(double) ctx->ch_bufs[1][ctx->width*i + j] / 255.0;
-					double y = 1.0 -
-						(double) ctx->ch_bufs[2][ctx->width*i + j] / 255.0;
-					double k = 1.0 -
-						(double) ctx->ch_bufs[3][ctx->width*i + j] / 255.0;
-					
-					pixels[3*j+0] = (1.0 - (c * (1.0 - k) + k)) * 255.0;
-					pixels[3*j+1] = (1.0 - (m * (1.0 - k) + k)) * 255.0;
-					pixels[3*j+2] = (1.0 - (y * (1.0 - k) + k)) * 255.0;
+			g_set_error (error, GDK_PIXBUF_ERROR,
+				GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+				("PSD file is truncated"));
+			return FALSE;
+		}
+		src[c] = buffer;
+		buffer += size;
+		pos[c] += size;
+	}
+	*row = y + rows;
+	return TRUE;
+}
+
+/* Sets pos to the start of each channel in channel data */
+static void
+channel_starts (PsdContext* ctx, guint64* pos)
+{
+	guint c;
+
+	for (c = 0; c < decoded_channels(ctx); c++) {
+		pos[c] = c == 0 ? 0 : pos[c - 1] +
+			channel_rows_size(ctx, c - 1, 0, ctx->height);
+	}
+}
+
+/* Returns size of rows of channel c that scale_tap_row() picks for
+   output rows first to last - 1 */
+static guint64
+tap_rows_size (PsdContext* ctx, guint c, guint first, guint last)
+{
+	guint64 size = 0;
+	guint y, t;
+
+	for (y = first; y < last; y++) {
+		for (t = 0; t < scale_row_taps(ctx, y); t++) {
+			size += channel_rows_size(ctx, c, scale_tap_row(ctx, y, t), 1);
+		}
+	}
+	return size;
+}
+
+/*
+ * Like read_channel_rows, but reads only the rows scale_tap_row() picks
+ * for output rows first to last - 1, back to back as reduce_rows takes
+ * them when packed. row holds the row pos is at in each channel.
+ */
+static gboolean
+read_tap_rows (PsdContext*    ctx,
+               FILE*          f,
+               off_t          start,
+               guint64*       pos,
+               guint*         row,
+               guint          first,
+               guint          last,
+               guchar*        buffer,
+               const guchar** src,
+               GError**       error)
+{
+	guint n = decoded_channels(ctx);
+	guint c, y, t;
+
+	for (c = 0; c < n; c++) {
+		src[c] = buffer;
+		for (y = first; y < last; y++) {
+			for (t = 0; t < scale_row_taps(ctx, y); t++) {
+				guint r = scale_tap_row(ctx, y, t);
+				gsize size;
+
+				pos[c] += channel_rows_size(ctx, c, row[c], r - row[c]);
+				size = channel_rows_size(ctx, c, r, 1);
+				if (fseeko(f, start + (off_t) pos[c], SEEK_SET) != 0 ||
+				    fread(buffer, 1, size, f) != size)
+				{
+					g_set_error (error, GDK_PIXBUF_ERROR,
+						GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+						("PSD file is truncated"));
+					return FALSE;
 				}
-				pixels += gdk_pixbuf_get_rowstride(ctx->pixbuf);
+				buffer += size;
+				pos[c] += size;
+				row[c] = r + 1;
 			}
 		}
-		ctx->finalized = TRUE;
 	}
-	
 	return TRUE;
 }
 
+/*
+ * Decodes the whole image from f, positioned at the start of channel
+ * data, for files that cannot be mapped. Like decode_to_bands, only one
+ * band of channel data is in memory at a time. When the image is scaled
+ * down, only the rows reduce_rows uses are read and the rest are sought
+ * over.
+ */
+static GdkPixbuf*
+decode_file (PsdContext* ctx, FILE* f, GError** error)
+{
+	guint n = decoded_channels(ctx);
+	guint64 pos[PSD_MAX_PLANES];
+	guint tap_row[PSD_MAX_PLANES];  /* row pos is at, when scaled */
+	guint64 buffer_size = 0;
+	guchar* buffer = NULL;
+	PsdArena* block = NULL;
+	gsize scratch_size;
+	off_t start = ftello(f);
+	guint c, y, row = 0;
+	gboolean ok = FALSE;
+
+	if (start < 0) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_FAILED,
+			("Failed to read PSD file"));
+		return NULL;
+	}
+	if (!setup_output(ctx, TRUE, 0, 0, 0, 0, error)) {
+		return NULL;
+	}
+	/* transparency is not read ahead to see whether it is opaque, the
+	   pixbuf keeps it as when it is streamed */
+
+	/* the largest band of rows read */
+	channel_starts(ctx, pos);
+	memset(tap_row, 0, sizeof(tap_row));
+	for (y = 0; y < ctx->out_height; y += PSD_BAND_ROWS) {
+		guint last = MIN(y + PSD_BAND_ROWS, ctx->out_height);
+		guint64 size = 0;
+		for (c = 0; c < n; c++) {
+			size += ctx->scaled ? tap_rows_size(ctx, c, y, last) :
+				channel_rows_size(ctx, c, y, last - y);
+		}
+		buffer_size = MAX(buffer_size, size);
+	}
+
+	scratch_size = bands_scratch_size(ctx);
+	if (buffer_size != (gsize) buffer_size) {
+		goto nomem;
+	}
+	buffer = g_try_malloc(MAX(buffer_size, 1));
+	ctx->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, ctx->has_alpha, 8,
+		ctx->out_width, ctx->out_height);
+	if (scratch_size > 0) {
+		block = pool_take(scratch_size);
+	}
+	if (buffer == NULL || ctx->pixbuf == NULL ||
+	    (scratch_size > 0 && block == NULL))
+	{
+		goto nomem;
+	}
+
+	for (y = 0; y < ctx->out_height; y += PSD_BAND_ROWS) {
+		guint last = MIN(y + PSD_BAND_ROWS, ctx->out_height);
+		guchar* scratch = block ? block->data : NULL;
+		const guchar* src[PSD_MAX_PLANES];
+		gboolean got;
+
+		if (ctx->scaled) {
+			got = read_tap_rows(ctx, f, start, pos, tap_row, y, last,
+				buffer, src, error);
+		} else {
+			got = read_channel_rows(ctx, f, start, pos, &row, y,
+				last - y, buffer, src, error);
+		}
+		if (!got) {
+			goto out;
+		}
+		if (ctx->scaled ? !reduce_rows(ctx, src, y, last, scratch, TRUE) :
+		    !decode_rows(ctx, src, y, last, scratch))
+		{
+			g_set_error (error, GDK_PIXBUF_ERROR,
+				GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+				("Corrupted RLE data"));
+			goto out;
+		}
+	}
+	ok = TRUE;
+	goto out;
+
+nomem:
+	g_set_error (error, GDK_PIXBUF_ERROR,
+		GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+		("Insufficient memory to load PSD image file"));
+out:
+	if (block != NULL) {
+		pool_give(block);
+	}
+	if (!ok && ctx->pixbuf != NULL) {
+		g_object_unref(ctx->pixbuf);
+		ctx->pixbuf = NULL;
+	}
+	g_free(buffer);
+	return ctx->pixbuf;
+}
+
+/*
+ * Decodes the image from f, positioned at the start of channel data, in
+ * bands of band_height rows and passes each of them to func.
+ *
+ * Channel data is planar, so for every band the rows of each channel are
+ * read from where the line lengths say they start; only one band of
+ * channel data and one band of pixels are in memory at a time.
+ */
+static gboolean
+decode_to_bands (PsdContext*          ctx,
+                 FILE*                f,
+                 guint                band_height,
+                 GdkPixbufPsdBandFunc func,
+                 gpointer             user_data,
+                 GError**             error)
+{
+	guint n = decoded_channels(ctx);
+	guint64 pos[PSD_MAX_PLANES];  /* next band of each channel */
+	guint64 buffer_size = 0;
+	guchar* buffer = NULL;
+	PsdArena* block = NULL;
+	gsize scratch_size;
+	off_t start;
+	guint c, y, rows, row = 0;
+	gboolean ok = FALSE;
+
+	if (ctx->width == 0 || ctx->height == 0) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			("Image has zero size"));
+		return FALSE;
+	}
+	band_height = MIN(band_height, ctx->height);
+
+	/* shorter bands when the budgets are tight, with raw rows standing
+	   in for the compressed ones read into the buffer */
+	while (!charge_budget(ctx, load_cost(ctx, ctx->width, band_height) +
+			(guint64) band_height * ctx->width * ctx->depth_bytes * n))
+	{
+		if (band_height == 1) {
+			g_set_error (error, GDK_PIXBUF_ERROR,
+				GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+				("Image does not fit in the memory budget"));
+			return FALSE;
+		}
+		band_height /= 2;
+	}
+	start = ftello(f);
+
+	/* start of each channel, and the largest band */
+	channel_starts(ctx, pos);
+	for (y = 0; y < ctx->height; y += band_height) {
+		guint64 size = 0;
+		rows = MIN(band_height, ctx->height - y);
+		for (c = 0; c < n; c++) {
+			size += channel_rows_size(ctx, c, y, rows);
+		}
+		buffer_size = MAX(buffer_size, size);
+	}
+
+	ctx->x0 = 0;
+	ctx->out_width = ctx->width;
+	ctx->out_height = band_height;
+	if (ctx->color_mode == PSD_MODE_CMYK) {
+		ctx->apply_k = get_cmyk_kernel();
+	}
+
+	scratch_size = rows_scratch_size(ctx);
+	if (start < 0 || buffer_size != (gsize) buffer_size) {
+		goto nomem;
+	}
+	buffer = g_try_malloc(MAX(buffer_size, 1));
+	ctx->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, ctx->has_alpha, 8,
+		ctx->width, band_height);
+	if (scratch_size > 0) {
+		block = pool_take(scratch_size);
+	}
+	if (buffer == NULL || ctx->pixbuf == NULL ||
+	    (scratch_size > 0 && block == NULL))
+	{
+		goto nomem;
+	}
+
+	for (y = 0; y < ctx->height; y += rows) {
+		const guchar* src[PSD_MAX_PLANES];
+
+		rows = MIN(band_height, ctx->height - y);
+		if (!read_channel_rows(ctx, f, start, pos, &row, y, rows,
+				buffer, src, error))
+		{
+			goto out;
+		}
+
+		ctx->y0 = y;
+		if (!decode_rows(ctx, src, 0, rows, block ? block->data : NULL)) {
+			g_set_error (error, GDK_PIXBUF_ERROR,
+				GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+				("Corrupted RLE data"));
+			goto out;
+		}
+		if (!func(ctx->pixbuf, y, rows, user_data)) {
+			break;
+		}
+	}
+	ok = TRUE;
+	goto out;
+
+nomem:
+	g_set_error (error, GDK_PIXBUF_ERROR,
+		GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+		("Insufficient memory to load PSD image file"));
+out:
+	if (block != NULL) {
+		pool_give(block);
+	}
+	if (ctx->pixbuf != NULL) {
+		g_object_unref(ctx->pixbuf);
+		ctx->pixbuf = NULL;
+	}
+	g_free(buffer);
+	return ok;
+}
+
+
+G_MODULE_EXPORT void
+gdk_pixbuf_psd_set_cmyk_conversion (GdkPixbufPsdCmykConversion conversion)
+{
+	g_atomic_int_set(&cmyk_conversion, conversion);
+}
+
+G_MODULE_EXPORT void
+gdk_pixbuf_psd_set_16bit_conversion (GdkPixbufPsd16BitConversion conversion)
+{
+	g_atomic_int_set(&sample_conversion, conversion);
+}
+
+G_MODULE_EXPORT void
+gdk_pixbuf_psd_set_progressive_preview (gboolean enabled)
+{
+	g_atomic_int_set(&progressive_preview, enabled);
+}
+
+G_MODULE_EXPORT void
+gdk_pixbuf_psd_set_pool_size (gsize max_size)
+{
+	PsdArena* freed = NULL;
+	PsdContext* contexts[PSD_POOL_MAX_CONTEXTS];
+	guint n_contexts = 0;
+
+	g_mutex_lock(&pool_lock);
+	pool_max_size = max_size;
+	while (pool_size > pool_max_size) {
+		PsdArena* block = pool_blocks;
+		pool_blocks = block->next;
+		pool_size -= block->size;
+		block->next = freed;
+		freed = block;
+	}
+	if (pool_max_size == 0) {
+		n_contexts = pool_n_contexts;
+		memcpy(contexts, pool_contexts, n_contexts * sizeof(PsdContext*));
+		pool_n_contexts = 0;
+	}
+	g_mutex_unlock(&pool_lock);
+
+	while (n_contexts > 0) {
+		g_free(contexts[--n_contexts]);
+	}
+
+	while (freed != NULL) {
+		PsdArena* next = freed->next;
+		g_free(freed);
+		freed = next;
+	}
+}
+
+G_MODULE_EXPORT void
+gdk_pixbuf_psd_set_memory_budget (gsize per_load, gsize total)
+{
+	g_mutex_lock(&budget_lock);
+	load_budget = per_load;
+	total_budget = total;
+	g_mutex_unlock(&budget_lock);
+}
+
+G_MODULE_EXPORT GdkPixbuf*
+gdk_pixbuf_psd_load_region_from_data (const guchar* data,
+                                      gsize         size,
+                                      gint          x,
+                                      gint          y,
+                                      gint          width,
+                                      gint          height,
+                                      GError**      error)
+{
+	return load_data(data, size, FALSE, x, y, width, height, error);
+}
+
+G_MODULE_EXPORT GdkPixbuf*
+gdk_pixbuf_psd_load_region (const gchar* filename,
+                            gint         x,
+                            gint         y,
+                            gint         width,
+                            gint         height,
+                            GError**     error)
+{
+	GMappedFile* file;
+	GdkPixbuf* pixbuf;
+
+	/* only pages holding the line lengths and the region are read in */
+	file = g_mapped_file_new(filename, FALSE, error);
+	if (file == NULL) {
+		return NULL;
+	}
+	pixbuf = gdk_pixbuf_psd_load_region_from_data(
+		(const guchar*) g_mapped_file_get_contents(file),
+		g_mapped_file_get_length(file), x, y, width, height, error);
+	g_mapped_file_unref(file);
+	return pixbuf;
+}
+
+G_MODULE_EXPORT gboolean
+gdk_pixbuf_psd_list_layers_from_data (const guchar*       data,
+                                      gsize               size,
+                                      GdkPixbufPsdLayer** layers,
+                                      guint*              n_layers,
+                                      GError**            error)
+{
+	PsdContext ctx;
+	const guchar* section;
+	guint64 len;
+
+	*layers = NULL;
+	*n_layers = 0;
+	memset(&ctx, 0, sizeof(ctx));
+	if (find_sections(&ctx, data, size, &section, &len, error) == NULL) {
+		return FALSE;
+	}
+	return parse_layer_records(&ctx, data, section, len,
+		layers, n_layers, error);
+}
+
+G_MODULE_EXPORT gboolean
+gdk_pixbuf_psd_list_layers (const gchar*        filename,
+                            GdkPixbufPsdLayer** layers,
+                            guint*              n_layers,
+                            GError**            error)
+{
+	GMappedFile* file;
+	gboolean ok;
+
+	/* only pages holding the section lengths and layer records are read */
+	*layers = NULL;
+	*n_layers = 0;
+	file = g_mapped_file_new(filename, FALSE, error);
+	if (file == NULL) {
+		return FALSE;
+	}
+	ok = gdk_pixbuf_psd_list_layers_from_data(
+		(const guchar*) g_mapped_file_get_contents(file),
+		g_mapped_file_get_length(file), layers, n_layers, error);
+	g_mapped_file_unref(file);
+	return ok;
+}
+
+G_MODULE_EXPORT void
+gdk_pixbuf_psd_free_layers (GdkPixbufPsdLayer* layers, guint n_layers)
+{
+	free_layers(layers, n_layers);
+}
+
+G_MODULE_EXPORT gboolean
+gdk_pixbuf_psd_load_bands (const gchar*         filename,
+                           gint                 band_height,
+                           GdkPixbufPsdBandFunc func,
+                           gpointer             user_data,
+                           GError**             error)
+{
+	PsdContext ctx;
+	FILE* f;
+	gboolean ok;
+
+	if (band_height <= 0) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_FAILED,
+			("Band height must be positive"));
+		return FALSE;
+	}
+	f = g_fopen(filename, "rb");
+	if (f == NULL) {
+		gint save_errno = errno;
+		g_set_error (error, G_FILE_ERROR,
+			g_file_error_from_errno(save_errno),
+			("Failed to open '%s': %s"), filename, g_strerror(save_errno));
+		return FALSE;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ok = seek_image_data(&ctx, f, error) &&
+		read_image_data_header(&ctx, f, error) &&
+		decode_to_bands(&ctx, f, band_height, func, user_data, error);
+
+	arena_free(&ctx);
+	release_budget(&ctx);
+	fclose(f);
+	return ok;
+}
+
+/* keeps the pixbuf of a file decoded through load_increment */
+static void
+load_prepared (GdkPixbuf*          pixbuf,
+               GdkPixbufAnimation* anim,
+               gpointer            user_data)
+{
+	*(GdkPixbuf**) user_data = g_object_ref(pixbuf);
+}
+
+/* bytes read at once from files that cannot be mapped */
+#define PSD_STREAM_CHUNK (64 * 1024)
+
+/*
+ * Decodes a file that cannot be mapped, like a pipe, as it is read. Only
+ * a row of channel data is kept besides the pixbuf, so large documents
+ * never have to fit in memory.
+ */
+static GdkPixbuf*
+load_stream (FILE* f, GError** error)
+{
+	GdkPixbuf* pixbuf = NULL;
+	gpointer ctx;
+	guchar* buf;
+	gsize n;
+	gboolean ok = TRUE;
+
+	ctx = gdk_pixbuf__psd_image_begin_load(NULL, load_prepared, NULL,
+		&pixbuf, error);
+	if (ctx == NULL) {
+		return NULL;
+	}
+	buf = g_malloc(PSD_STREAM_CHUNK);
+	while (ok && (n = fread(buf, 1, PSD_STREAM_CHUNK, f)) > 0) {
+		ok = gdk_pixbuf__psd_image_load_increment(ctx, buf, n, error);
+	}
+	g_free(buf);
+	if (ok && ferror(f)) {
+		g_set_error (error, GDK_PIXBUF_ERROR,
+			GDK_PIXBUF_ERROR_FAILED,
+			("Failed to read PSD file"));
+		ok = FALSE;
+	}
+	if (!gdk_pixbuf__psd_image_stop_load(ctx, ok ? error : NULL)) {
+		ok = FALSE;
+	}
+	if (!ok && pixbuf != NULL) {
+		g_object_unref(pixbuf);
+		pixbuf = NULL;
+	}
+	return pixbuf;
+}
+
+/*
+ * Decodes a file that cannot be mapped but can seek, like a document
+ * larger than the address space. Sections before image data are sought
+ * over and channel rows are read from where the line lengths say.
+ */
+static GdkPixbuf*
+load_seekable (FILE* f, GError** error)
+{
+	PsdContext ctx;
+	GdkPixbuf* pixbuf = NULL;
+
+	memset(&ctx, 0, sizeof(ctx));
+	if (seek_image_data(&ctx, f, error) &&
+	    read_image_data_header(&ctx, f, error))
+	{
+		pixbuf = decode_file(&ctx, f, error);
+	}
+	arena_free(&ctx);
+	release_budget(&ctx);
+	return pixbuf;
+}
+
+/*
+ * Decodes the whole file at once. The file is mapped, so sections are
+ * found by offset and channel data is read in place instead of being
+ * copied through load_increment; only pages that are touched are read.
+ * Files that cannot be mapped are read from where image data starts if
+ * they can seek, or streamed otherwise.
+ */
+static GdkPixbuf*
+gdk_pixbuf__psd_image_load (FILE* f, GError** error)
+{
+	GMappedFile* file;
+	GdkPixbuf* pixbuf;
+
+	file = g_mapped_file_new_from_fd(fileno(f), FALSE, NULL);
+	if (file == NULL) {
+		if (ftello(f) < 0) {
+			return load_stream(f, error);
+		}
+		return load_seekable(f, error);
+	}
+
+	pixbuf = load_data((const guchar*) g_mapped_file_get_contents(file),
+		g_mapped_file_get_length(file), TRUE, 0, 0, 0, 0, error);
+	g_mapped_file_unref(file);
+	return pixbuf;
+}
+
 
 #ifndef INCLUDE_psd
 #define MODULE_ENTRY(function) G_MODULE_EXPORT void function
@@ -563,6 +4455,7 @@ gdk_pixbuf__psd_image_load_increment (gpointer      context_ptr,
 
 MODULE_ENTRY (fill_vtable) (GdkPixbufModule* module)
 {
+	module->load = gdk_pixbuf__psd_image_load;
 	module->begin_load = gdk_pixbuf__psd_image_begin_load;
 	module->stop_load = gdk_pixbuf__psd_image_stop_load;
 	module->load_increment = gdk_pixbuf__psd_image_load_increment;
@@ -581,6 +4474,7 @@ MODULE_ENTRY (fill_info) (GdkPixbufFormat *info)
 	};
 	static gchar * extensions[] = {
 		"psd",
+		"psb",
 		NULL
 	};
 
@@ -590,8 +4484,9 @@ MODULE_ENTRY (fill_info) (GdkPixbufFormat *info)
 	info->description = "Adobe Photoshop format";
 	info->mime_types = mime_types;
 	info->extensions = extensions;
+	/* all state lives in PsdContext; shared tables and the thread pool
+	   are set up once with g_once */
 	info->flags = GDK_PIXBUF_FORMAT_THREADSAFE;
-	info->flags = 0;
 	info->license = "LGPL";
 }
 
@@ -0,0 +1,182 @@
+/*
+ * GdkPixbuf library - PSD image loader
+ *
+ * Copyright (C) 2008 Jan Dudek
+ *
+ * Authors: Jan Dudek <jd@jandudek.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Functions exported by the loader module, for applications that need
+ * more control than the GdkPixbuf API gives. Settings apply to all loads
+ * started afterwards in the process.
+ *
+ * No library exports them: look each one up by name in the loader module
+ * with g_module_symbol() and call it through the matching pointer type
+ * below, e.g.
+ *
+ *   GdkPixbufPsdSetCmykConversionFunc set_cmyk;
+ *   if (g_module_symbol(module, "gdk_pixbuf_psd_set_cmyk_conversion",
+ *                       (gpointer*) &set_cmyk))
+ *       set_cmyk(GDK_PIXBUF_PSD_CMYK_NAIVE);
+ *
+ * The prototypes themselves are only declared for building the module.
+ */
+
+#ifndef IO_PSD_H
+#define IO_PSD_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+	/* multiply C, M and Y by K; fast but colors are off */
+	GDK_PIXBUF_PSD_CMYK_NAIVE,
+	/* interpolate in a table built from a model of coated press output */
+	GDK_PIXBUF_PSD_CMYK_BUILTIN_PROFILE
+} GdkPixbufPsdCmykConversion;
+
+typedef void (*GdkPixbufPsdSetCmykConversionFunc) (GdkPixbufPsdCmykConversion conversion);
+
+typedef enum
+{
+	/* keep the high byte of each sample; fastest */
+	GDK_PIXBUF_PSD_16BIT_TRUNCATE,
+	/* round to the nearest 8-bit value */
+	GDK_PIXBUF_PSD_16BIT_ROUND,
+	/* ordered 4x4 dither, hides banding of smooth gradients */
+	GDK_PIXBUF_PSD_16BIT_DITHER
+} GdkPixbufPsd16BitConversion;
+
+/* How samples of 16-bit images are reduced to the 8 bits of a pixbuf. */
+typedef void (*GdkPixbufPsdSet16BitConversionFunc) (GdkPixbufPsd16BitConversion conversion);
+
+/* While the first channel of an RGB or CMYK image streams in, show it
+   as grayscale through the updated callback. On by default. */
+typedef void (*GdkPixbufPsdSetProgressivePreviewFunc) (gboolean enabled);
+
+/* Buffers of finished loads are kept for the next ones, up to max_size
+   bytes in total. Off (0) by default; 0 releases them and turns it off. */
+typedef void (*GdkPixbufPsdSetPoolSizeFunc) (gsize max_size);
+
+/* Limit the memory one load, and all loads in progress together, may
+   take, 0 for no limit (the default). The cost is estimated from the
+   header before anything large is allocated. Images over it are decoded
+   scaled down to fit, bands are made shorter, and regions fail with
+   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY. */
+typedef void (*GdkPixbufPsdSetMemoryBudgetFunc) (gsize per_load, gsize total);
+
+/* Decode only the given rectangle of the composite image of a PSD file,
+   or of a whole file in memory. Rows outside of it are not decompressed.
+   Returns a new pixbuf of width x height, or NULL with error set. */
+typedef GdkPixbuf* (*GdkPixbufPsdLoadRegionFunc) (const gchar* filename,
+                                                  gint x, gint y,
+                                                  gint width, gint height,
+                                                  GError** error);
+typedef GdkPixbuf* (*GdkPixbufPsdLoadRegionFromDataFunc) (const guchar* data,
+                                                          gsize size,
+                                                          gint x, gint y,
+                                                          gint width,
+                                                          gint height,
+                                                          GError** error);
+
+/* Receives rows y to y + height - 1 of the image in the first height rows
+   of band, which is reused for the next band. Return FALSE to stop. */
+typedef gboolean (*GdkPixbufPsdBandFunc) (GdkPixbuf* band,
+                                          gint y, gint height,
+                                          gpointer user_data);
+
+/* Decode the composite image of a PSD file band_height rows at a time,
+   for images too large for one pixbuf. Memory used does not depend on
+   the image height. Returns FALSE with error set on failure. */
+typedef gboolean (*GdkPixbufPsdLoadBandsFunc) (const gchar* filename,
+                                               gint band_height,
+                                               GdkPixbufPsdBandFunc func,
+                                               gpointer user_data,
+                                               GError** error);
+
+typedef struct
+{
+	gint16  id;      /* 0, 1... color, -1 transparency, -2 and -3 masks */
+	guint64 offset;  /* in the file, of the compression type */
+	guint64 length;  /* including the compression type */
+} GdkPixbufPsdLayerChannel;
+
+typedef struct
+{
+	gchar*   name;            /* UTF-8 */
+	gint     top, left, bottom, right;
+	gchar    blend_mode[5];   /* key such as "norm" or "mul " */
+	guint8   opacity;         /* 255 is opaque */
+	gboolean visible;
+	guint    n_channels;
+	GdkPixbufPsdLayerChannel* channels;
+} GdkPixbufPsdLayer;
+
+/* List the layers of a PSD file, bottom one first, reading only their
+   records and none of the pixels. Free the list with
+   gdk_pixbuf_psd_free_layers(). Returns FALSE with error set on failure. */
+typedef gboolean (*GdkPixbufPsdListLayersFunc) (const gchar* filename,
+                                                GdkPixbufPsdLayer** layers,
+                                                guint* n_layers,
+                                                GError** error);
+typedef gboolean (*GdkPixbufPsdListLayersFromDataFunc) (const guchar* data,
+                                                        gsize size,
+                                                        GdkPixbufPsdLayer** layers,
+                                                        guint* n_layers,
+                                                        GError** error);
+typedef void (*GdkPixbufPsdFreeLayersFunc) (GdkPixbufPsdLayer* layers,
+                                            guint n_layers);
+
+#ifdef GDK_PIXBUF_PSD_COMPILATION
+void gdk_pixbuf_psd_set_cmyk_conversion (GdkPixbufPsdCmykConversion conversion);
+void gdk_pixbuf_psd_set_16bit_conversion (GdkPixbufPsd16BitConversion conversion);
+void gdk_pixbuf_psd_set_progressive_preview (gboolean enabled);
+void gdk_pixbuf_psd_set_pool_size (gsize max_size);
+void gdk_pixbuf_psd_set_memory_budget (gsize per_load, gsize total);
+GdkPixbuf* gdk_pixbuf_psd_load_region (const gchar* filename,
+                                       gint x, gint y,
+                                       gint width, gint height,
+                                       GError** error);
+GdkPixbuf* gdk_pixbuf_psd_load_region_from_data (const guchar* data,
+                                                 gsize size,
+                                                 gint x, gint y,
+                                                 gint width, gint height,
+                                                 GError** error);
+gboolean gdk_pixbuf_psd_load_bands (const gchar* filename,
+                                    gint band_height,
+                                    GdkPixbufPsdBandFunc func,
+                                    gpointer user_data,
+                                    GError** error);
+gboolean gdk_pixbuf_psd_list_layers (const gchar* filename,
+                                     GdkPixbufPsdLayer** layers,
+                                     guint* n_layers,
+                                     GError** error);
+gboolean gdk_pixbuf_psd_list_layers_from_data (const guchar* data,
+                                               gsize size,
+                                               GdkPixbufPsdLayer** layers,
+                                               guint* n_layers,
+                                               GError** error);
+void gdk_pixbuf_psd_free_layers (GdkPixbufPsdLayer* layers, guint n_layers);
+#endif
+
+G_END_DECLS
+
+#endif